@@ -6,6 +6,38 @@
 #include <string>
 #include <exception>
 #include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <random>
+#include <fstream>
+#include <charconv>
+#include <string_view>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <type_traits>
+#include <array>
+#include <variant>
+#include <stdexcept>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CARTEASE_X86_SIMD 1
+#endif
 using namespace std;
 
 /*
@@ -29,55 +61,100 @@ The Factory Design Pattern is used in the above code to create instances of diff
 Clothing) based on user input.
 The ProductFactory class serves as the factory and abstracts the creation of specific product objects.
 
-In the code, the ProductFactory class provides a static method createProduct(string category) that takes a product category as input.
+In the code, the ProductFactory class provides a static method createProduct(string_view category) that takes a product category as input.
 Based on the provided category, the factory method creates an instance of the corresponding product category (Electronics, Furniture, or
 Clothing). The factory method handles the instantiation and initialization of the product objects, shielding the client code from the
 internal details.
 
 */
 
+// Expected failures on the order path. ProductFactory, Inventory and Customer
+// return them as values so a rejected request costs the same as a normal
+// return; the exceptions below remain for callers that want to throw.
+enum class OrderError : uint8_t
+{
+    INVALID_CATEGORY,
+    INVALID_ELECTRONICS,
+    INVALID_FURNITURE,
+    INVALID_CLOTHING,
+    INVALID_PRODUCT, // missing or malformed product fields
+    PRODUCT_NOT_FOUND,
+    NEGATIVE_QUANTITY,
+    OUT_OF_STOCK,
+    INVALID_ORDER_ID,
+    PAYMENT_FAILED
+};
+
+inline const char *describe(OrderError error)
+{
+    switch (error)
+    {
+    case OrderError::INVALID_CATEGORY:
+        return "Invalid Category,the given category of products do not exist.";
+    case OrderError::INVALID_ELECTRONICS:
+        return "Invalid Electronics: The requested item was not found.";
+    case OrderError::INVALID_FURNITURE:
+        return "Invalid furniture: The requested item was not found.";
+    case OrderError::INVALID_CLOTHING:
+        return "Invalid clothing: The requested item was not found.";
+    case OrderError::INVALID_PRODUCT:
+        return "Failed to create the product. Invalid or missing input.";
+    case OrderError::PRODUCT_NOT_FOUND:
+        return "Product not found in the inventory.";
+    case OrderError::NEGATIVE_QUANTITY:
+        return "Invalid quantity: Quantity cannot be negative.";
+    case OrderError::OUT_OF_STOCK:
+        return "Insufficient stock: The requested quantity is not available.";
+    case OrderError::INVALID_ORDER_ID:
+        return "Invalid Order ID. The provided Order ID does not exist.";
+    case OrderError::PAYMENT_FAILED:
+        return "Payment processing failed.";
+    }
+    return "Unknown order error.";
+}
+
 class PaymentProcessingException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Payment processing failed.";
+        return describe(OrderError::PAYMENT_FAILED);
     }
 };
 
 class ProductNotFoundException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Product not found in the inventory.";
+        return describe(OrderError::PRODUCT_NOT_FOUND);
     }
 };
 
 class ProductCreationException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Failed to create the product. Invalid or missing input.";
+        return describe(OrderError::INVALID_PRODUCT);
     }
 };
 
 class InvalidCategoryException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Invalid Category,the given category of products do not exist.";
+        return describe(OrderError::INVALID_CATEGORY);
     }
 };
 
 class InvalidElectronicsException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Invalid Electronics: The requested item was not found.";
+        return describe(OrderError::INVALID_ELECTRONICS);
     }
 };
 
@@ -86,7 +163,7 @@ class InvalidFurnitureException : public exception
 public:
     const char *what() const noexcept override
     {
-        return "Invalid furniture: The requested item was not found.";
+        return describe(OrderError::INVALID_FURNITURE);
     }
 };
 
@@ -95,618 +172,7366 @@ class InvalidClothingException : public exception
 public:
     const char *what() const noexcept override
     {
-        return "Invalid clothing: The requested item was not found.";
+        return describe(OrderError::INVALID_CLOTHING);
     }
 };
 
 class NegativeQuantityException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Invalid quantity: Quantity cannot be negative.";
+        return describe(OrderError::NEGATIVE_QUANTITY);
     }
 };
 
 class InvalidOrderIDException : public exception
 {
 public:
-    const char *what()
+    const char *what() const noexcept override
     {
-        return "Invalid Order ID. The provided Order ID does not exist.";
+        return describe(OrderError::INVALID_ORDER_ID);
     }
 };
 
-class Product // abstract class
+class OutOfStockException : public exception
 {
 public:
-    int product_id;
-    string product_name;
-    double price;
-    int quantity;
-
-    Product()
-    {
-        product_id = 0;
-        price = 0.0;
-        quantity = 0;
-        this->product_name = "";
-    }
-    Product(int pid, string pname, double price)
+    const char *what() const noexcept override
     {
-        this->product_id = pid;
-        this->product_name = pname;
-        this->price = price;
-        this->quantity = 1000;
+        return describe(OrderError::OUT_OF_STOCK);
     }
+};
 
-    virtual void displayDetails() = 0;
-
-    bool isOutOfStock()
+class InventoryFullException : public exception
+{
+public:
+    const char *what() const noexcept override
     {
-        return quantity == 0;
+        return "Inventory is full: no room for more products.";
     }
-    void increaseStock(int quantityToAdd)
+};
+
+class CustomerNotFoundException : public exception
+{
+public:
+    const char *what() const noexcept override
     {
-        quantity += quantityToAdd;
+        return "Customer not found.";
     }
-    double getPrice()
+};
+
+class DuplicateCustomerException : public exception
+{
+public:
+    const char *what() const noexcept override
     {
-        return price;
+        return "A customer with this ID already exists.";
     }
-    ~Product()
+};
+
+class HistoryPagingException : public exception
+{
+public:
+    const char *what() const noexcept override
     {
-        cout << "Destructor called for product : " << product_name;
+        return "Order history could not be paged to or from disk.";
     }
 };
 
-class Electronics : public Product // abstract class
+class ReportWriteException : public exception
 {
 public:
-    string brand;
-
-    Electronics() : Product()
+    const char *what() const noexcept override
     {
-        this->brand = "";
+        return "Report could not be written.";
     }
+};
 
-    Electronics(int pid, string pname, double price, string brand)
-        : Product(pid, pname, price)
+class JournalException : public exception
+{
+public:
+    const char *what() const noexcept override
     {
-        this->brand = brand;
+        return "Order journal could not be opened or written.";
     }
-
-    virtual void displayDetails() = 0;
 };
 
-class Furniture : public Product // abstract class
+class SnapshotException : public exception
 {
 public:
-    string material;
-    Furniture() : Product()
+    const char *what() const noexcept override
     {
-        this->material = "";
+        return "Catalogue snapshot is missing, corrupt or of an unsupported version.";
     }
+};
 
-    Furniture(int pid, string pname, double price, string material)
-        : Product(pid, pname, price)
+// Throws the exception that matches the error
+[[noreturn]] inline void throwOrderError(OrderError error)
+{
+    switch (error)
     {
-        this->material = material;
+    case OrderError::INVALID_CATEGORY:
+        throw InvalidCategoryException();
+    case OrderError::INVALID_ELECTRONICS:
+        throw InvalidElectronicsException();
+    case OrderError::INVALID_FURNITURE:
+        throw InvalidFurnitureException();
+    case OrderError::INVALID_CLOTHING:
+        throw InvalidClothingException();
+    case OrderError::PRODUCT_NOT_FOUND:
+        throw ProductNotFoundException();
+    case OrderError::NEGATIVE_QUANTITY:
+        throw NegativeQuantityException();
+    case OrderError::OUT_OF_STOCK:
+        throw OutOfStockException();
+    case OrderError::INVALID_ORDER_ID:
+        throw InvalidOrderIDException();
+    case OrderError::PAYMENT_FAILED:
+        throw PaymentProcessingException();
+    default:
+        throw ProductCreationException();
     }
+}
 
-    virtual void displayDetails() = 0;
-};
-
-class Clothing : public Product // abstract class
+// Either a value or the OrderError that prevented it. value() throws the
+// matching exception when there is no value.
+template <typename T>
+class Expected
 {
 public:
-    string size;
-    string color;
-    Clothing() : Product()
+    Expected(T value)
     {
-        this->size = "";
-        this->color = "";
+        this->stored = move(value);
+        this->failure = OrderError();
+        this->ok = true;
+    }
+    Expected(OrderError error)
+    {
+        this->failure = error;
+        this->ok = false;
     }
 
-    Clothing(int pid, string pname, double price, string size, string color)
-        : Product(pid, pname, price)
+    bool hasValue() const
     {
-        this->size = size;
-        this->color = color;
+        return ok;
+    }
+    explicit operator bool() const
+    {
+        return ok;
+    }
+    OrderError error() const
+    {
+        return failure;
     }
 
-    virtual void displayDetails() = 0;
+    T &value()
+    {
+        if (!ok)
+        {
+            throwOrderError(failure);
+        }
+        return stored;
+    }
+    T &operator*()
+    {
+        return stored;
+    }
+    T *operator->()
+    {
+        return &stored;
+    }
+
+private:
+    T stored{};
+    OrderError failure;
+    bool ok;
 };
 
-class Laptop : public Electronics
+// Outcome of an operation that has no value to return
+template <>
+class Expected<void>
 {
 public:
-    string processor;
-    int ram;
+    Expected()
+    {
+        this->failure = OrderError();
+        this->ok = true;
+    }
+    Expected(OrderError error)
+    {
+        this->failure = error;
+        this->ok = false;
+    }
 
-    Laptop() : Electronics()
+    bool hasValue() const
     {
-        ram = 0;
-        processor = "";
+        return ok;
     }
-    Laptop(int pid, string pname, double price, string brand, string processor, int ram)
-        : Electronics(pid, pname, price, brand)
+    explicit operator bool() const
     {
-        this->processor = processor;
-        this->ram = ram;
+        return ok;
     }
-    void displayDetails()
+    OrderError error() const
+    {
+        return failure;
+    }
+
+    void value() const
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "Processor: " << processor << endl;
-        cout << "RAM: " << ram << "GB" << endl;
+        if (!ok)
+        {
+            throwOrderError(failure);
+        }
     }
+
+private:
+    OrderError failure;
+    bool ok;
 };
 
-class Mobile : public Electronics
+// An amount of money in minor units (paise). Integer arithmetic keeps every
+// sum exact and associative, so totals do not depend on the order in which
+// lines are added up and can be computed in parallel or with SIMD.
+class Money
 {
 public:
-    int storage;
-    int ram;
-    Mobile() : Electronics()
+    int64_t minorUnits;
+
+    Money()
     {
-        storage = 0;
-        ram = 0;
+        minorUnits = 0;
     }
-    Mobile(int pid, string pname, double price, string brand, int storage, int ram)
-        : Electronics(pid, pname, price, brand)
+    explicit Money(int64_t minorUnits)
     {
-        this->storage = storage;
-        this->ram = ram;
+        this->minorUnits = minorUnits;
     }
-    void displayDetails()
+
+    // Parses amounts such as "499", "499.5" or "499.99", at most two decimals.
+    // Amounts that do not fit in minorUnits fail to parse.
+    static bool parse(string_view text, Money &amount)
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "RAM: " << ram << "GB" << endl;
-        cout << "Storage capacity: " << storage << "GB" << endl;
-    }
-};
+        bool negative = !text.empty() && text[0] == '-';
+        if (negative)
+        {
+            text.remove_prefix(1);
+        }
+        size_t dot = text.find('.');
+        string_view whole = text.substr(0, dot);
+        string_view fraction = dot == string_view::npos ? string_view() : text.substr(dot + 1);
+        if ((whole.empty() && fraction.empty()) || fraction.size() > 2 || (!whole.empty() && whole[0] == '-'))
+        {
+            return false;
+        }
 
-class Chair : public Furniture
-{
-public:
-    string color;
-    string chair_type;
+        int64_t units = 0;
+        if (!whole.empty())
+        {
+            auto result = from_chars(whole.data(), whole.data() + whole.size(), units);
+            if (result.ec != errc() || result.ptr != whole.data() + whole.size())
+            {
+                return false;
+            }
+        }
+        int64_t cents = 0;
+        for (size_t i = 0; i < 2; i++)
+        {
+            char digit = i < fraction.size() ? fraction[i] : '0';
+            if (digit < '0' || digit > '9')
+            {
+                return false;
+            }
+            cents = cents * 10 + (digit - '0');
+        }
+        int64_t total;
+        if (__builtin_mul_overflow(units, 100, &total) || __builtin_add_overflow(total, cents, &total))
+        {
+            return false;
+        }
+        amount.minorUnits = negative ? -total : total;
+        return true;
+    }
 
-    Chair() : Furniture()
+    // Always two decimals, e.g. "499.50"
+    string toString() const
     {
-        this->color = "";
-        this->chair_type = "";
+        int64_t absolute = minorUnits < 0 ? -minorUnits : minorUnits;
+        string text = minorUnits < 0 ? "-" : "";
+        text += to_string(absolute / 100);
+        text += '.';
+        text += (char)('0' + absolute % 100 / 10);
+        text += (char)('0' + absolute % 10);
+        return text;
     }
 
-    Chair(int pid, string pname, double price, string material, string color, string chair_type)
-        : Furniture(pid, pname, price, material)
+    Money operator+(Money other) const
     {
-        this->color = color;
-        this->chair_type = chair_type;
+        return Money(minorUnits + other.minorUnits);
     }
-    void displayDetails()
+    Money operator-(Money other) const
+    {
+        return Money(minorUnits - other.minorUnits);
+    }
+    Money operator*(int64_t quantity) const
+    {
+        return Money(minorUnits * quantity);
+    }
+    Money &operator+=(Money other)
+    {
+        minorUnits += other.minorUnits;
+        return *this;
+    }
+    Money &operator-=(Money other)
+    {
+        minorUnits -= other.minorUnits;
+        return *this;
+    }
+    bool operator==(Money other) const
+    {
+        return minorUnits == other.minorUnits;
+    }
+    bool operator!=(Money other) const
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "Chair Type: " << chair_type << endl;
-        cout << "Chair color : " << color << endl;
+        return minorUnits != other.minorUnits;
+    }
+    bool operator<(Money other) const
+    {
+        return minorUnits < other.minorUnits;
+    }
+    bool operator<=(Money other) const
+    {
+        return minorUnits <= other.minorUnits;
+    }
+    bool operator>(Money other) const
+    {
+        return minorUnits > other.minorUnits;
+    }
+    bool operator>=(Money other) const
+    {
+        return minorUnits >= other.minorUnits;
     }
 };
 
-class Table : public Furniture
+ostream &operator<<(ostream &out, Money amount)
+{
+    return out << amount.toString();
+}
+
+// Text assembled in a reusable buffer and handed to a file descriptor or a
+// stream in large writes, instead of flushing line by line. Numbers are
+// formatted with to_chars straight into the buffer. A buffer without a sink
+// only accumulates, see writeTo().
+class ReportBuffer
 {
 public:
-    int capacity;
+    ReportBuffer() {}
+    ReportBuffer(int fd, size_t flushBytes = 1 << 16)
+    {
+        this->fd = fd;
+        this->flushBytes = flushBytes;
+    }
+    ReportBuffer(ostream &stream, size_t flushBytes = 1 << 16)
+    {
+        this->stream = &stream;
+        this->flushBytes = flushBytes;
+    }
 
-    Table() : Furniture()
+    ~ReportBuffer()
     {
-        capacity = 0;
+        flush();
     }
 
-    Table(int pid, string pname, double price, string material, int capacity)
-        : Furniture(pid, pname, price, material)
+    ReportBuffer(const ReportBuffer &) = delete;
+    ReportBuffer &operator=(const ReportBuffer &) = delete;
+
+    ReportBuffer &operator<<(string_view text)
     {
-        this->capacity = capacity;
+        buffer.append(text.data(), text.size());
+        return written();
     }
-    void displayDetails()
+    ReportBuffer &operator<<(const char *text)
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "Table capacity : " << endl;
+        return *this << string_view(text);
     }
-};
-
-class Shirt : public Clothing
-{
-public:
-    string fabric;
-    Shirt() : Clothing()
+    ReportBuffer &operator<<(const string &text)
     {
-        this->fabric = "";
+        return *this << string_view(text);
+    }
+    ReportBuffer &operator<<(char c)
+    {
+        buffer += c;
+        return written();
     }
 
-    Shirt(int pid, string pname, double price, string size, string color, string fabric)
-        : Clothing(pid, pname, price, size, color)
+    template <typename T, typename = enable_if_t<is_integral<T>::value && !is_same<T, char>::value>>
+    ReportBuffer &operator<<(T value)
     {
-        this->fabric = fabric;
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, result.ptr - digits);
+        return written();
     }
 
-    void displayDetails()
+    // Same format as Money::toString
+    ReportBuffer &operator<<(Money amount)
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "Fabric: " << fabric << endl;
-        cout << "Color of shirt : " << color << endl;
+        int64_t absolute = amount.minorUnits < 0 ? -amount.minorUnits : amount.minorUnits;
+        if (amount.minorUnits < 0)
+        {
+            buffer += '-';
+        }
+        *this << absolute / 100;
+        buffer += '.';
+        buffer += (char)('0' + absolute % 100 / 10);
+        buffer += (char)('0' + absolute % 10);
+        return written();
     }
-};
 
-class Jeans : public Clothing
-{
-public:
-    string denim_style;
+    // Fixed notation with three decimals
+    ReportBuffer &operator<<(double value)
+    {
+        char digits[64];
+        auto result = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, 3);
+        buffer.append(digits, result.ptr - digits);
+        return written();
+    }
 
-    Jeans() : Clothing()
+    size_t size() const
     {
-        denim_style = "";
+        return buffer.size();
     }
 
-    Jeans(int pid, string pname, double price, string size, string color, string denim_style)
-        : Clothing(pid, pname, price, size, color)
+    const string &text() const
     {
-        this->denim_style = denim_style;
+        return buffer;
     }
 
-    void displayDetails()
+    // Drops the buffered text without writing it
+    void clear()
     {
-        cout << "Product ID: " << product_id << endl;
-        cout << "Name: " << product_name << endl;
-        cout << "Price: " << price << endl;
-        cout << "Denim Style: " << denim_style << endl;
+        buffer.clear();
     }
-};
 
-// Factory class for creating products
-class ProductFactory
-{
-public:
-    static unique_ptr<Product> createProduct(string category)
+    // Hands the buffered text to the sink, returns false if it could not be
+    // written. The buffer is emptied either way.
+    bool flush()
     {
-        try
+        bool ok = true;
+        if (fd >= 0)
         {
-            if (category == "Electronics")
-            {
-                return createElectronicsProduct();
-            }
-            else if (category == "Furniture")
-            {
-                return createFurnitureProduct();
-            }
-            else if (category == "Clothing")
-            {
-                return createClothingProduct();
-            }
-            else
-            {
-                throw InvalidCategoryException();
-            }
+            ok = writeTo(fd);
         }
-        catch (InvalidCategoryException &ice)
+        else if (stream != NULL)
         {
-            cout << ice.what();
+            stream->write(buffer.data(), buffer.size());
+            stream->flush();
+            ok = !stream->fail();
         }
-        return NULL;
+        buffer.clear();
+        return ok;
     }
 
-private:
-
-    static unique_ptr<Electronics> createElectronicsProduct()
+    // Writes the buffered text to fd and empties the buffer
+    bool writeTo(int out)
     {
-        char productType;
-        cout << "Enter the type of electronics (L for Laptop, M for Mobile): ";
-        cin >> productType;
+        size_t done = 0;
+        while (done < buffer.size())
+        {
+            ssize_t n = write(out, buffer.data() + done, buffer.size() - done);
+            if (n < 0 && errno != EINTR)
+            {
+                buffer.clear();
+                return false;
+            }
+            done += n > 0 ? n : 0;
+        }
+        buffer.clear();
+        return true;
+    }
+
+private:
+    string buffer;
+    int fd = -1;
+    ostream *stream = NULL;
+    size_t flushBytes = SIZE_MAX; // a buffer without a sink never flushes by itself
+
+    ReportBuffer &written()
+    {
+        if (buffer.size() >= flushBytes)
+        {
+            flush();
+        }
+        return *this;
+    }
+};
+
+// Hot path counters and latency histograms.
+//
+// Every thread records into its own cache line aligned slot with plain
+// relaxed loads and stores, so recording costs a few nanoseconds and threads
+// never contend. A slot is handed to a thread on its first record and goes
+// back to the registry when the thread exits, for the next new thread to
+// keep counting in. Counts survive their threads, and there are only ever
+// as many slots as threads recording at once. Readers sum the
+// slots on demand; a sum taken while threads record may be a few events
+// behind, which is fine for monitoring.
+//
+// Histograms are HDR style: log-linear buckets with 16 sub-buckets per power
+// of two, about 6% relative error from 1ns up to about 18 minutes.
+class Metrics
+{
+public:
+    enum Counter
+    {
+        ORDERS_PLACED,
+        ORDERS_DECLINED, // payment declined
+        ORDERS_REJECTED, // out of stock, unknown product or bad quantity
+        ORDERS_CANCELLED,
+        CANCELS_REJECTED, // unknown or already cancelled order
+        PAYMENTS_AUTHORIZED,
+        PAYMENTS_DECLINED,
+        PAYMENT_BATCHES,
+        STOCK_RESERVATIONS,
+        STOCK_SHORTAGES,
+        COUNTER_COUNT
+    };
+
+    enum Histogram
+    {
+        PLACE_ORDER_LATENCY, // until the payment result is known
+        CANCEL_ORDER_LATENCY,
+        PAYMENT_LATENCY, // queueing, batching and the gateway round trip
+        STOCK_RESERVATION_LATENCY,
+        HISTOGRAM_COUNT
+    };
+
+    static void count(Counter counter, uint64_t n = 1)
+    {
+        atomic<uint64_t> &value = local().counters[counter];
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    static void record(Histogram histogram, chrono::nanoseconds elapsed)
+    {
+        ThreadSlot &slot = local();
+        uint64_t nanoseconds = elapsed.count() > 0 ? elapsed.count() : 0;
+        atomic<uint64_t> &bucket = slot.buckets[histogram][bucketOf(nanoseconds)];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic<uint64_t> &sum = slot.sums[histogram];
+        sum.store(sum.load(memory_order_relaxed) + nanoseconds, memory_order_relaxed);
+    }
+
+    static void recordSince(Histogram histogram, chrono::steady_clock::time_point start)
+    {
+        record(histogram, chrono::steady_clock::now() - start);
+    }
+
+    // Records the time from construction to destruction
+    class Timer
+    {
+    public:
+        Timer(Histogram histogram)
+        {
+            this->histogram = histogram;
+            start = chrono::steady_clock::now();
+        }
+        ~Timer()
+        {
+            recordSince(histogram, start);
+        }
+
+    private:
+        Histogram histogram;
+        chrono::steady_clock::time_point start;
+    };
+
+    static uint64_t total(Counter counter)
+    {
+        Registry &registry = instance();
+        lock_guard<mutex> lock(registry.slotsLock);
+        uint64_t sum = 0;
+        for (const auto &slot : registry.slots)
+        {
+            sum += slot->counters[counter].load(memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // Latency at quantile q of everything recorded so far, 0 if nothing was
+    static chrono::nanoseconds quantile(Histogram histogram, double q)
+    {
+        vector<uint64_t> merged;
+        uint64_t sum;
+        uint64_t samples = mergeHistogram(histogram, merged, sum);
+        return chrono::nanoseconds(quantileOf(merged, samples, q));
+    }
+
+    // Writes every counter and histogram in the Prometheus text format.
+    // Histograms are exported as summaries, their quantiles come from the
+    // HDR buckets.
+    static void writePrometheus(ReportBuffer &out)
+    {
+        static const char *counterNames[COUNTER_COUNT] = {
+            "cartease_orders_placed_total", "cartease_orders_declined_total", "cartease_orders_rejected_total",
+            "cartease_orders_cancelled_total", "cartease_cancels_rejected_total",
+            "cartease_payments_authorized_total", "cartease_payments_declined_total",
+            "cartease_payment_batches_total", "cartease_stock_reservations_total",
+            "cartease_stock_shortages_total"};
+        static const char *histogramNames[HISTOGRAM_COUNT] = {
+            "cartease_place_order_seconds", "cartease_cancel_order_seconds", "cartease_payment_seconds",
+            "cartease_stock_reservation_seconds"};
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+        for (int counter = 0; counter < COUNTER_COUNT; counter++)
+        {
+            out << "# TYPE " << counterNames[counter] << " counter\n";
+            out << counterNames[counter] << ' ' << total((Counter)counter) << '\n';
+        }
+        vector<uint64_t> merged;
+        for (int histogram = 0; histogram < HISTOGRAM_COUNT; histogram++)
+        {
+            uint64_t sum;
+            uint64_t samples = mergeHistogram((Histogram)histogram, merged, sum);
+            const char *name = histogramNames[histogram];
+            out << "# TYPE " << name << " summary\n";
+            for (double q : quantiles)
+            {
+                out << name << "{quantile=\"";
+                writeNumber(out, q);
+                out << "\"} ";
+                writeNumber(out, quantileOf(merged, samples, q) / 1e9);
+                out << '\n';
+            }
+            out << name << "_sum ";
+            writeNumber(out, sum / 1e9);
+            out << '\n' << name << "_count " << samples << '\n';
+        }
+    }
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int MAX_EXPONENT = 40; // 2^40ns, longer latencies land in the last bucket
+    static constexpr int BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    struct alignas(64) ThreadSlot
+    {
+        atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        atomic<uint64_t> sums[HISTOGRAM_COUNT] = {};
+        atomic<uint64_t> buckets[HISTOGRAM_COUNT][BUCKETS] = {};
+    };
+
+    struct Registry
+    {
+        mutex slotsLock;
+        vector<unique_ptr<ThreadSlot>> slots;
+        vector<ThreadSlot *> released; // slots of threads that exited
+    };
+
+    // Holds a thread's slot and releases it when the thread exits
+    struct SlotLease
+    {
+        ThreadSlot *slot;
+
+        SlotLease()
+        {
+            Registry &registry = instance();
+            lock_guard<mutex> lock(registry.slotsLock);
+            if (registry.released.empty())
+            {
+                registry.slots.push_back(make_unique<ThreadSlot>());
+                slot = registry.slots.back().get();
+            }
+            else
+            {
+                slot = registry.released.back();
+                registry.released.pop_back();
+            }
+        }
+
+        ~SlotLease()
+        {
+            Registry &registry = instance();
+            lock_guard<mutex> lock(registry.slotsLock);
+            registry.released.push_back(slot);
+        }
+
+        SlotLease(const SlotLease &) = delete;
+        SlotLease &operator=(const SlotLease &) = delete;
+    };
+
+    static Registry &instance()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    static ThreadSlot &local()
+    {
+        thread_local SlotLease lease;
+        return *lease.slot;
+    }
+
+    // Values below SUB_BUCKETS get a bucket each, above that every power of
+    // two is split into SUB_BUCKETS equal parts
+    static int bucketOf(uint64_t value)
+    {
+        if (value < (uint64_t)SUB_BUCKETS)
+        {
+            return (int)value;
+        }
+        int exponent = min(63 - __builtin_clzll(value), MAX_EXPONENT);
+        if (exponent == MAX_EXPONENT)
+        {
+            return BUCKETS - 1;
+        }
+        int sub = (int)(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    // Midpoint of the values that fall into the bucket
+    static uint64_t valueOf(int bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+        {
+            return bucket;
+        }
+        int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+        return ((uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS)) + width / 2;
+    }
+
+    // Sums the histogram over every thread into merged, returns the sample count
+    static uint64_t mergeHistogram(Histogram histogram, vector<uint64_t> &merged, uint64_t &sum)
+    {
+        merged.assign(BUCKETS, 0);
+        sum = 0;
+        uint64_t samples = 0;
+        Registry &registry = instance();
+        lock_guard<mutex> lock(registry.slotsLock);
+        for (const auto &slot : registry.slots)
+        {
+            sum += slot->sums[histogram].load(memory_order_relaxed);
+            for (int bucket = 0; bucket < BUCKETS; bucket++)
+            {
+                uint64_t n = slot->buckets[histogram][bucket].load(memory_order_relaxed);
+                merged[bucket] += n;
+                samples += n;
+            }
+        }
+        return samples;
+    }
+
+    static uint64_t quantileOf(const vector<uint64_t> &merged, uint64_t samples, double q)
+    {
+        if (samples == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = min(samples - 1, (uint64_t)(q * samples));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++)
+        {
+            seen += merged[bucket];
+            if (seen > rank)
+            {
+                return valueOf(bucket);
+            }
+        }
+        return valueOf(BUCKETS - 1);
+    }
+
+    // Shortest representation that reads back as the same double
+    static void writeNumber(ReportBuffer &out, double value)
+    {
+        char digits[32];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        out << string_view(digits, result.ptr - digits);
+    }
+};
+
+// Writes the metrics in the Prometheus text format to a file on a background
+// thread, for a node exporter textfile collector or a local scraper. The file
+// is replaced atomically, readers never see a partial dump.
+class MetricsExporter
+{
+public:
+    MetricsExporter(const string &path, chrono::milliseconds interval = chrono::milliseconds(10000))
+    {
+        this->path = path;
+        this->interval = interval;
+    }
+
+    ~MetricsExporter()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        lock_guard<mutex> lock(stateLock);
+        if (worker.joinable())
+        {
+            return;
+        }
+        running = true;
+        worker = thread(&MetricsExporter::run, this);
+    }
+
+    // Stops the thread and writes a last dump
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(stateLock);
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+        }
+        wakeup.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+        dump();
+    }
+
+    bool dump()
+    {
+        string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool ok;
+        {
+            ReportBuffer out;
+            Metrics::writePrometheus(out);
+            ok = out.writeTo(fd);
+        }
+        close(fd);
+        return ok && rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    string path;
+    chrono::milliseconds interval;
+    bool running = false;
+    mutex stateLock;
+    condition_variable wakeup;
+    thread worker;
+
+    void run()
+    {
+        unique_lock<mutex> lock(stateLock);
+        while (running)
+        {
+            wakeup.wait_for(lock, interval);
+            if (running)
+            {
+                lock.unlock();
+                dump();
+                lock.lock();
+            }
+        }
+    }
+};
+
+// Maps repeated attribute strings (brands, materials, colours, sizes) to small
+// integer ids, so the product table stores and compares integers. Id 0 is the
+// empty string.
+class StringInterner
+{
+public:
+    StringInterner()
+    {
+        intern("");
+    }
+
+    uint32_t intern(string_view value)
+    {
+        auto it = ids.find(value);
+        if (it != ids.end())
+        {
+            return it->second;
+        }
+        uint32_t id = (uint32_t)values.size();
+        values.emplace_back(value);
+        ids.emplace(values.back(), id);
+        return id;
+    }
+
+    // Returns 0 if the value was never interned
+    uint32_t find(const string &value) const
+    {
+        auto it = ids.find(value);
+        return it == ids.end() ? 0 : it->second;
+    }
+
+    const string &lookup(uint32_t id) const
+    {
+        return values[id];
+    }
+
+    size_t size() const
+    {
+        return values.size();
+    }
+
+private:
+    deque<string> values; // deque keeps the keys of ids in place as it grows
+    unordered_map<string_view, uint32_t> ids;
+};
+
+enum ProductCategory : uint8_t
+{
+    CATEGORY_ELECTRONICS,
+    CATEGORY_FURNITURE,
+    CATEGORY_CLOTHING
+};
+
+// Columnar storage for the hot product fields. Row r of every column belongs
+// to the same product, so pricing, stock and report scans walk dense arrays
+// instead of chasing Product pointers. Stock counters are atomics and safe to
+// use from many threads. Appending rows is not safe to overlap with any other
+// use of the table, except that an append within reserved capacity never
+// moves the existing rows, so their stock counters stay usable meanwhile.
+class ProductTable
+{
+public:
+    vector<int> ids;
+    vector<int64_t> prices; // minor units, see Money
+    vector<uint8_t> categories;
+    vector<char> types; // first letter of the concrete class
+    vector<uint32_t> brands;
+    vector<uint32_t> materials;
+    vector<uint32_t> colors;
+    vector<uint32_t> sizes;
+    vector<int32_t> rams; // GB, electronics only
+    vector<int32_t> storages;
+    StringInterner strings;
+
+    uint32_t append(int productId, Money price, int units, ProductCategory category, char type)
+    {
+        uint32_t row = (uint32_t)ids.size();
+        if (row == capacity)
+        {
+            grow(max<size_t>(capacity * 2, 1024));
+        }
+        ids.push_back(productId);
+        prices.push_back(price.minorUnits);
+        categories.push_back(category);
+        types.push_back(type);
+        brands.push_back(0);
+        materials.push_back(0);
+        colors.push_back(0);
+        sizes.push_back(0);
+        rams.push_back(0);
+        storages.push_back(0);
+        stock[row].store(units, memory_order_relaxed);
+        reserved[row].store(0, memory_order_relaxed);
+        return row;
+    }
+
+    void reserve(size_t rows)
+    {
+        if (rows > capacity)
+        {
+            grow(rows);
+        }
+        ids.reserve(rows);
+        prices.reserve(rows);
+        categories.reserve(rows);
+        types.reserve(rows);
+        brands.reserve(rows);
+        materials.reserve(rows);
+        colors.reserve(rows);
+        sizes.reserve(rows);
+        rams.reserve(rows);
+        storages.reserve(rows);
+    }
+
+    size_t size() const
+    {
+        return ids.size();
+    }
+
+    int stockLevel(uint32_t row) const
+    {
+        return stock[row].load(memory_order_relaxed);
+    }
+
+    int reservedLevel(uint32_t row) const
+    {
+        return reserved[row].load(memory_order_relaxed);
+    }
+
+    void increaseStock(uint32_t row, int units)
+    {
+        stock[row].fetch_add(units);
+    }
+
+    // Moves units from the free stock into the reserved pool. Lock-free, so
+    // concurrent checkouts never oversell: the CAS only succeeds while enough
+    // units remain.
+    bool reserveStock(uint32_t row, int units)
+    {
+        int available = stock[row].load(memory_order_relaxed);
+        while (available >= units)
+        {
+            if (stock[row].compare_exchange_weak(available, available - units, memory_order_acq_rel))
+            {
+                reserved[row].fetch_add(units, memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The order was paid, the reserved units leave the warehouse
+    void commitStock(uint32_t row, int units)
+    {
+        reserved[row].fetch_sub(units, memory_order_relaxed);
+    }
+
+    // The order was cancelled or payment failed, the units go back on sale
+    void releaseStock(uint32_t row, int units)
+    {
+        reserved[row].fetch_sub(units, memory_order_relaxed);
+        stock[row].fetch_add(units, memory_order_release);
+    }
+
+    // Sum of price * units over every product that has stock
+    Money totalStockValue() const
+    {
+        int64_t total = 0;
+        for (size_t row = 0; row < ids.size(); row++)
+        {
+            total += prices[row] * stock[row].load(memory_order_relaxed);
+        }
+        return Money(total);
+    }
+
+    long long totalStock() const
+    {
+        long long total = 0;
+        for (size_t row = 0; row < ids.size(); row++)
+        {
+            total += stock[row].load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+    size_t countOutOfStock() const
+    {
+        size_t count = 0;
+        for (size_t row = 0; row < ids.size(); row++)
+        {
+            count += stock[row].load(memory_order_relaxed) == 0;
+        }
+        return count;
+    }
+
+    // Units in stock per ProductCategory
+    vector<long long> stockByCategory() const
+    {
+        vector<long long> totals(CATEGORY_CLOTHING + 1, 0);
+        for (size_t row = 0; row < ids.size(); row++)
+        {
+            totals[categories[row]] += stock[row].load(memory_order_relaxed);
+        }
+        return totals;
+    }
+
+private:
+    unique_ptr<atomic<int>[]> stock;    // units in stock and free to sell
+    unique_ptr<atomic<int>[]> reserved; // units held by orders awaiting payment
+    size_t capacity = 0;
+
+    void grow(size_t newCapacity)
+    {
+        unique_ptr<atomic<int>[]> newStock(new atomic<int>[newCapacity]);
+        unique_ptr<atomic<int>[]> newReserved(new atomic<int>[newCapacity]);
+        for (size_t row = 0; row < ids.size(); row++)
+        {
+            newStock[row].store(stock[row].load(memory_order_relaxed), memory_order_relaxed);
+            newReserved[row].store(reserved[row].load(memory_order_relaxed), memory_order_relaxed);
+        }
+        stock = move(newStock);
+        reserved = move(newReserved);
+        capacity = newCapacity;
+    }
+};
+
+// Slab allocator for objects of one type. Memory is taken from the heap a
+// slab of SLAB_SIZE objects at a time and kept; destroyed objects go on a
+// free list and their slots are reused, so memory stays flat under a steady
+// load and most allocations are a free list pop.
+template <typename T>
+class ObjectPool
+{
+public:
+    ObjectPool() {}
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        void *memory = allocate();
+        try
+        {
+            return new (memory) T(forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            deallocate(memory);
+            throw;
+        }
+    }
+
+    void destroy(T *object)
+    {
+        object->~T();
+        deallocate(object);
+    }
+
+    size_t liveObjects()
+    {
+        lock_guard<mutex> guard(lock);
+        return live;
+    }
+
+    size_t capacity()
+    {
+        lock_guard<mutex> guard(lock);
+        return slabs.size() * SLAB_SIZE;
+    }
+
+private:
+    static const size_t SLAB_SIZE = 256;
+
+    union Slot
+    {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    vector<unique_ptr<Slot[]>> slabs;
+    Slot *freeList = NULL;
+    size_t live = 0;
+    mutex lock;
+
+    void *allocate()
+    {
+        lock_guard<mutex> guard(lock);
+        if (freeList == NULL)
+        {
+            slabs.emplace_back(new Slot[SLAB_SIZE]);
+            Slot *slab = slabs.back().get();
+            for (size_t i = 0; i < SLAB_SIZE; i++)
+            {
+                slab[i].next = freeList;
+                freeList = &slab[i];
+            }
+        }
+        Slot *slot = freeList;
+        freeList = slot->next;
+        live++;
+        return slot->storage;
+    }
+
+    void deallocate(void *memory)
+    {
+        lock_guard<mutex> guard(lock);
+        Slot *slot = (Slot *)memory;
+        slot->next = freeList;
+        freeList = slot;
+        live--;
+    }
+};
+
+class Laptop;
+class Mobile;
+class Chair;
+class Table;
+class Shirt;
+class Jeans;
+
+// The closed set of concrete product types. A type's position in this list
+// is its ProductType; its code, columns and prompts are in ProductTraits.
+template <typename... Types>
+struct ProductTypeList
+{
+};
+
+using ProductTypes = ProductTypeList<Laptop, Mobile, Chair, Table, Shirt, Jeans>;
+
+typedef uint8_t ProductType;
+
+template <typename T, typename... Types>
+constexpr ProductType productTypeIn(ProductTypeList<Types...>)
+{
+    constexpr bool matches[] = {is_same<T, Types>::value...};
+    for (size_t i = 0; i < sizeof...(Types); i++)
+    {
+        if (matches[i])
+        {
+            return (ProductType)i;
+        }
+    }
+    return (ProductType)sizeof...(Types);
+}
+
+template <typename T>
+inline constexpr ProductType productTypeOf = productTypeIn<T>(ProductTypes());
+
+template <typename List>
+struct ProductVariantOf;
+
+template <typename... Types>
+struct ProductVariantOf<ProductTypeList<Types...>>
+{
+    typedef variant<Types...> type;
+};
+
+// A product held by value. Its index is its ProductType.
+typedef ProductVariantOf<ProductTypes>::type ProductValue;
+
+class Product // abstract class
+{
+public:
+    int product_id;
+    string product_name;
+    Money price;
+    int quantity; // stock the product starts with, the table tracks it once the product is in an Inventory
+
+    // Once the product joins an Inventory its price and stock live in the
+    // inventory's ProductTable and the Product reads them through its row
+    ProductTable *table = NULL;
+    uint32_t row = 0;
+
+    ProductType productType = 0; // set by makeProduct
+
+    Product()
+    {
+        product_id = 0;
+        price = Money();
+        quantity = 0;
+        this->product_name = "";
+    }
+    Product(int pid, string pname, Money price)
+    {
+        this->product_id = pid;
+        this->product_name = pname;
+        this->price = price;
+        this->quantity = 1000;
+    }
+
+    // Writes the product's details to out, one field per line
+    virtual void writeDetails(ReportBuffer &out) = 0;
+
+    void displayDetails()
+    {
+        ReportBuffer out(cout);
+        writeDetails(out);
+    }
+
+    int stockLevel()
+    {
+        return table != NULL ? table->stockLevel(row) : quantity;
+    }
+    bool isOutOfStock()
+    {
+        return stockLevel() == 0;
+    }
+    void increaseStock(int quantityToAdd)
+    {
+        if (table != NULL)
+        {
+            table->increaseStock(row, quantityToAdd);
+        }
+        else
+        {
+            quantity += quantityToAdd;
+        }
+    }
+
+    // Stock can only be reserved for products that are in an Inventory
+    bool reserveStock(int units)
+    {
+        return table != NULL && table->reserveStock(row, units);
+    }
+    void commitStock(int units)
+    {
+        table->commitStock(row, units);
+    }
+    void releaseStock(int units)
+    {
+        table->releaseStock(row, units);
+    }
+    Money getPrice()
+    {
+        return table != NULL ? Money(table->prices[row]) : price;
+    }
+    virtual ~Product() {}
+};
+
+class Electronics : public Product // abstract class
+{
+public:
+    string brand;
+
+    Electronics() : Product()
+    {
+        this->brand = "";
+    }
+
+    Electronics(int pid, string pname, Money price, string brand)
+        : Product(pid, pname, price)
+    {
+        this->brand = brand;
+    }
+
+    virtual void writeDetails(ReportBuffer &out) = 0;
+};
+
+class Furniture : public Product // abstract class
+{
+public:
+    string material;
+    Furniture() : Product()
+    {
+        this->material = "";
+    }
+
+    Furniture(int pid, string pname, Money price, string material)
+        : Product(pid, pname, price)
+    {
+        this->material = material;
+    }
+
+    virtual void writeDetails(ReportBuffer &out) = 0;
+};
+
+class Clothing : public Product // abstract class
+{
+public:
+    string size;
+    string color;
+    Clothing() : Product()
+    {
+        this->size = "";
+        this->color = "";
+    }
+
+    Clothing(int pid, string pname, Money price, string size, string color)
+        : Product(pid, pname, price)
+    {
+        this->size = size;
+        this->color = color;
+    }
+
+    virtual void writeDetails(ReportBuffer &out) = 0;
+};
+
+class Laptop final : public Electronics
+{
+public:
+    string processor;
+    int ram;
+
+    Laptop() : Electronics()
+    {
+        ram = 0;
+        processor = "";
+    }
+    Laptop(int pid, string pname, Money price, string brand, string processor, int ram)
+        : Electronics(pid, pname, price, brand)
+    {
+        this->processor = processor;
+        this->ram = ram;
+    }
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "Processor: " << processor << '\n';
+        out << "RAM: " << ram << "GB\n";
+    }
+};
+
+class Mobile final : public Electronics
+{
+public:
+    int storage;
+    int ram;
+    Mobile() : Electronics()
+    {
+        storage = 0;
+        ram = 0;
+    }
+    Mobile(int pid, string pname, Money price, string brand, int storage, int ram)
+        : Electronics(pid, pname, price, brand)
+    {
+        this->storage = storage;
+        this->ram = ram;
+    }
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "RAM: " << ram << "GB\n";
+        out << "Storage capacity: " << storage << "GB\n";
+    }
+};
+
+class Chair final : public Furniture
+{
+public:
+    string color;
+    string chair_type;
+
+    Chair() : Furniture()
+    {
+        this->color = "";
+        this->chair_type = "";
+    }
+
+    Chair(int pid, string pname, Money price, string material, string color, string chair_type)
+        : Furniture(pid, pname, price, material)
+    {
+        this->color = color;
+        this->chair_type = chair_type;
+    }
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "Chair Type: " << chair_type << '\n';
+        out << "Chair color : " << color << '\n';
+    }
+};
+
+class Table final : public Furniture
+{
+public:
+    int capacity;
+
+    Table() : Furniture()
+    {
+        capacity = 0;
+    }
+
+    Table(int pid, string pname, Money price, string material, int capacity)
+        : Furniture(pid, pname, price, material)
+    {
+        this->capacity = capacity;
+    }
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "Table capacity : " << capacity << '\n';
+    }
+};
+
+class Shirt final : public Clothing
+{
+public:
+    string fabric;
+    Shirt() : Clothing()
+    {
+        this->fabric = "";
+    }
+
+    Shirt(int pid, string pname, Money price, string size, string color, string fabric)
+        : Clothing(pid, pname, price, size, color)
+    {
+        this->fabric = fabric;
+    }
+
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "Fabric: " << fabric << '\n';
+        out << "Color of shirt : " << color << '\n';
+    }
+};
+
+class Jeans final : public Clothing
+{
+public:
+    string denim_style;
+
+    Jeans() : Clothing()
+    {
+        denim_style = "";
+    }
+
+    Jeans(int pid, string pname, Money price, string size, string color, string denim_style)
+        : Clothing(pid, pname, price, size, color)
+    {
+        this->denim_style = denim_style;
+    }
+
+    void writeDetails(ReportBuffer &out) override
+    {
+        out << "Product ID: " << product_id << '\n';
+        out << "Name: " << product_name << '\n';
+        out << "Price: " << price << '\n';
+        out << "Denim Style: " << denim_style << '\n';
+    }
+};
+
+class Inventory;
+
+// One catalogue row, every field is a view into the loaded file
+struct CatalogueRecord
+{
+    string_view type;
+    string_view productId;
+    string_view name;
+    string_view price;
+    string_view stock;
+    string_view attributes[3]; // type specific, in the order of the CSV columns
+};
+
+struct CatalogueLoadResult
+{
+    size_t loaded = 0;
+    size_t rejected = 0; // malformed rows and duplicate product ids
+};
+
+// Products come from one ObjectPool per concrete type. A ProductPtr returns
+// the product to the pool it came from.
+template <typename T>
+ObjectPool<T> &productPool()
+{
+    static ObjectPool<T> pool;
+    return pool;
+}
+
+struct ProductDeleter
+{
+    void (*release)(Product *) = NULL;
+
+    void operator()(Product *product) const
+    {
+        release(product);
+    }
+};
+
+typedef unique_ptr<Product, ProductDeleter> ProductPtr;
+
+template <typename T, typename... Args>
+ProductPtr makeProduct(Args &&...args)
+{
+    ProductDeleter deleter;
+    deleter.release = [](Product *product)
+    {
+        productPool<T>().destroy(static_cast<T *>(product));
+    };
+    T *product = productPool<T>().create(forward<Args>(args)...);
+    product->productType = productTypeOf<T>;
+    return ProductPtr(product, deleter);
+}
+
+template <typename T>
+static bool parseNumber(string_view field, T &value)
+{
+    const char *end = field.data() + field.size();
+    auto result = from_chars(field.data(), end, value);
+    return result.ec == errc() && result.ptr == end;
+}
+
+// Catalogue table column an attribute is indexed in
+enum ProductColumn : uint8_t
+{
+    COLUMN_NONE,
+    COLUMN_BRAND,
+    COLUMN_MATERIAL,
+    COLUMN_COLOR,
+    COLUMN_SIZE,
+    COLUMN_RAM,
+    COLUMN_STORAGE
+};
+
+// A type specific field, in the order of the catalogue file columns
+struct AttributeSpec
+{
+    const char *key; // JSON key and interactive field, NULL if the column is unused
+    bool numeric;
+    ProductColumn column;
+};
+
+// Asks for one field on the interactive console
+struct FieldPrompt
+{
+    const char *key; // NULL ends the list
+    const char *text;
+};
+
+// The type specific fields of one product, slot i holds attribute i
+struct AttributeValues
+{
+    string_view text[3];
+    int numbers[3] = {0, 0, 0};
+};
+
+// What the catalogue code knows about a concrete product type: its name,
+// code letter, category, attributes and the extra fields the console asks for,
+// plus how to build one from attribute values and read them back.
+template <typename T>
+struct ProductTraits;
+
+template <>
+struct ProductTraits<Laptop>
+{
+    static constexpr const char *name = "Laptop";
+    static constexpr char code = 'L';
+    static constexpr ProductCategory category = CATEGORY_ELECTRONICS;
+    static constexpr AttributeSpec attributes[3] = {
+        {"brand", false, COLUMN_BRAND}, {"processor", false, COLUMN_NONE}, {"ram", true, COLUMN_RAM}};
+    static constexpr FieldPrompt prompts[2] = {};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        // The console does not ask for the processor
+        string processor = values.text[1].empty() ? "Intel" : string(values.text[1]);
+        return makeProduct<Laptop>(id, name, price, string(values.text[0]), processor, values.numbers[2]);
+    }
+    static void read(const Laptop &laptop, AttributeValues &values)
+    {
+        values.text[0] = laptop.brand;
+        values.text[1] = laptop.processor;
+        values.numbers[2] = laptop.ram;
+    }
+};
+
+template <>
+struct ProductTraits<Mobile>
+{
+    static constexpr const char *name = "Mobile";
+    static constexpr char code = 'M';
+    static constexpr ProductCategory category = CATEGORY_ELECTRONICS;
+    static constexpr AttributeSpec attributes[3] = {
+        {"brand", false, COLUMN_BRAND}, {"storage", true, COLUMN_STORAGE}, {"ram", true, COLUMN_RAM}};
+    static constexpr FieldPrompt prompts[2] = {{"storage", "Enter storage (for mobiles): "}};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        return makeProduct<Mobile>(id, name, price, string(values.text[0]), values.numbers[1], values.numbers[2]);
+    }
+    static void read(const Mobile &mobile, AttributeValues &values)
+    {
+        values.text[0] = mobile.brand;
+        values.numbers[1] = mobile.storage;
+        values.numbers[2] = mobile.ram;
+    }
+};
+
+template <>
+struct ProductTraits<Chair>
+{
+    static constexpr const char *name = "Chair";
+    static constexpr char code = 'C';
+    static constexpr ProductCategory category = CATEGORY_FURNITURE;
+    static constexpr AttributeSpec attributes[3] = {
+        {"material", false, COLUMN_MATERIAL}, {"color", false, COLUMN_COLOR}, {"chair_type", false, COLUMN_NONE}};
+    static constexpr FieldPrompt prompts[2] = {{"chair_type", "Enter the chair type: "},
+                                               {"color", "Enter the color of chair : "}};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        return makeProduct<Chair>(id, name, price, string(values.text[0]), string(values.text[1]),
+                                  string(values.text[2]));
+    }
+    static void read(const Chair &chair, AttributeValues &values)
+    {
+        values.text[0] = chair.material;
+        values.text[1] = chair.color;
+        values.text[2] = chair.chair_type;
+    }
+};
+
+template <>
+struct ProductTraits<Table>
+{
+    static constexpr const char *name = "Table";
+    static constexpr char code = 'T';
+    static constexpr ProductCategory category = CATEGORY_FURNITURE;
+    static constexpr AttributeSpec attributes[3] = {
+        {"material", false, COLUMN_MATERIAL}, {"capacity", true, COLUMN_NONE}, {NULL, false, COLUMN_NONE}};
+    static constexpr FieldPrompt prompts[2] = {{"capacity", "Enter capacity (for tables): "}};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        return makeProduct<Table>(id, name, price, string(values.text[0]), values.numbers[1]);
+    }
+    static void read(const Table &table, AttributeValues &values)
+    {
+        values.text[0] = table.material;
+        values.numbers[1] = table.capacity;
+    }
+};
+
+template <>
+struct ProductTraits<Shirt>
+{
+    static constexpr const char *name = "Shirt";
+    static constexpr char code = 'S';
+    static constexpr ProductCategory category = CATEGORY_CLOTHING;
+    static constexpr AttributeSpec attributes[3] = {
+        {"size", false, COLUMN_SIZE}, {"color", false, COLUMN_COLOR}, {"fabric", false, COLUMN_NONE}};
+    static constexpr FieldPrompt prompts[2] = {{"fabric", "Enter the fabric of shirt:\n"}};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        return makeProduct<Shirt>(id, name, price, string(values.text[0]), string(values.text[1]),
+                                  string(values.text[2]));
+    }
+    static void read(const Shirt &shirt, AttributeValues &values)
+    {
+        values.text[0] = shirt.size;
+        values.text[1] = shirt.color;
+        values.text[2] = shirt.fabric;
+    }
+};
+
+template <>
+struct ProductTraits<Jeans>
+{
+    static constexpr const char *name = "Jeans";
+    static constexpr char code = 'J';
+    static constexpr ProductCategory category = CATEGORY_CLOTHING;
+    static constexpr AttributeSpec attributes[3] = {
+        {"size", false, COLUMN_SIZE}, {"color", false, COLUMN_COLOR}, {"denim_style", false, COLUMN_NONE}};
+    static constexpr FieldPrompt prompts[2] = {{"denim_style", "Enter the denim style : "}};
+
+    static ProductPtr create(int id, const string &name, Money price, const AttributeValues &values)
+    {
+        return makeProduct<Jeans>(id, name, price, string(values.text[0]), string(values.text[1]),
+                                  string(values.text[2]));
+    }
+    static void read(const Jeans &jeans, AttributeValues &values)
+    {
+        values.text[0] = jeans.size;
+        values.text[1] = jeans.color;
+        values.text[2] = jeans.denim_style;
+    }
+};
+
+// Dispatch tables generated from ProductTypes at compile time. Everything
+// type specific goes through an array indexed by ProductType, so a lookup is
+// one table jump and a new product type only needs its ProductTypes entry
+// and its ProductTraits.
+template <typename List>
+class ProductRegistry;
+
+template <typename... Types>
+class ProductRegistry<ProductTypeList<Types...>>
+{
+private:
+    template <typename T>
+    static void readAs(const Product &product, AttributeValues &values)
+    {
+        ProductTraits<T>::read(static_cast<const T &>(product), values);
+    }
+
+    template <typename T>
+    static ProductValue copyAs(const Product &product)
+    {
+        return ProductValue(in_place_type<T>, static_cast<const T &>(product));
+    }
+
+    // ASCII type code, either case, to ProductType; -1 for unused codes
+    static constexpr array<int8_t, 128> codeTable()
+    {
+        array<int8_t, 128> table{};
+        for (auto &entry : table)
+        {
+            entry = -1;
+        }
+        constexpr char letters[] = {ProductTraits<Types>::code...};
+        for (size_t i = 0; i < sizeof...(Types); i++)
+        {
+            table[(unsigned char)letters[i]] = (int8_t)i;
+            table[(unsigned char)(letters[i] | 0x20)] = (int8_t)i;
+        }
+        return table;
+    }
+
+    static constexpr bool codesUnique()
+    {
+        constexpr char letters[] = {ProductTraits<Types>::code...};
+        for (size_t i = 0; i < sizeof...(Types); i++)
+        {
+            for (size_t j = 0; j < i; j++)
+            {
+                if ((letters[i] | 0x20) == (letters[j] | 0x20))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static constexpr array<int8_t, 128> byCode = codeTable();
+
+    static bool sameName(string_view text, const char *name)
+    {
+        size_t i = 0;
+        for (; i < text.size() && name[i] != 0; i++)
+        {
+            if (tolower((unsigned char)text[i]) != tolower((unsigned char)name[i]))
+            {
+                return false;
+            }
+        }
+        return i == text.size() && name[i] == 0;
+    }
+
+public:
+    typedef ProductPtr (*Creator)(int, const string &, Money, const AttributeValues &);
+    typedef void (*Reader)(const Product &, AttributeValues &);
+    typedef ProductValue (*Copier)(const Product &);
+
+    static constexpr size_t size = sizeof...(Types);
+    static constexpr const char *names[size] = {ProductTraits<Types>::name...};
+    static constexpr char codes[size] = {ProductTraits<Types>::code...};
+    static constexpr ProductCategory categories[size] = {ProductTraits<Types>::category...};
+    static constexpr const AttributeSpec *attributes[size] = {ProductTraits<Types>::attributes...};
+    static constexpr const FieldPrompt *prompts[size] = {ProductTraits<Types>::prompts...};
+    static constexpr Creator creators[size] = {&ProductTraits<Types>::create...};
+    static constexpr Reader readers[size] = {&readAs<Types>...};
+    static constexpr Copier copiers[size] = {&copyAs<Types>...};
+
+    static_assert(codesUnique(), "product type codes must be unique letters");
+
+    // -1 if no product type has this code
+    static int find(char code)
+    {
+        return (unsigned char)code < byCode.size() ? byCode[(unsigned char)code] : -1;
+    }
+
+    // Takes a whole type field, either the code letter or the type name in
+    // any case. -1 if it is neither.
+    static int find(string_view type)
+    {
+        if (type.size() == 1)
+        {
+            return find(type[0]);
+        }
+        for (size_t i = 0; i < size; i++)
+        {
+            if (sameName(type, names[i]))
+            {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    static ProductPtr create(ProductType type, int id, const string &name, Money price,
+                             const AttributeValues &values)
+    {
+        return creators[type](id, name, price, values);
+    }
+
+    static void read(const Product &product, AttributeValues &values)
+    {
+        readers[product.productType](product, values);
+    }
+
+    static ProductValue copy(const Product &product)
+    {
+        return copiers[product.productType](product);
+    }
+
+    // Fills values from the raw text of the type's attribute columns, false
+    // if a numeric attribute does not parse
+    static bool parseAttributes(ProductType type, const string_view raw[3], AttributeValues &values)
+    {
+        const AttributeSpec *specs = attributes[type];
+        for (int i = 0; i < 3; i++)
+        {
+            if (specs[i].key == NULL)
+            {
+                continue;
+            }
+            if (!specs[i].numeric)
+            {
+                values.text[i] = raw[i];
+            }
+            else if (!parseNumber(raw[i], values.numbers[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+typedef ProductRegistry<ProductTypes> ProductTypeRegistry;
+
+// What the console asks for when adding a product of a category. Indexed by
+// ProductCategory.
+struct CategorySpec
+{
+    const char *name;
+    const char *typePrompt;
+    FieldPrompt prompts[2]; // shared by the category's types, asked before the type is checked
+    OrderError invalidType;
+};
+
+inline constexpr CategorySpec CATEGORY_SPECS[] = {
+    {"Electronics", "Enter the type of electronics (L for Laptop, M for Mobile): ",
+     {{"brand", "Enter brand: "}, {"ram", "Enter RAM : "}}, OrderError::INVALID_ELECTRONICS},
+    {"Furniture", "Enter the type of furniture (C for Chair, T for Table): ",
+     {{"material", "Enter material: "}}, OrderError::INVALID_FURNITURE},
+    {"Clothing", "Enter the type of clothing (S for Shirt, J for Jeans): ",
+     {{"size", "Enter size (for clothing): "}, {"color", "Enter color (for clothing): "}},
+     OrderError::INVALID_CLOTHING},
+};
+
+// The low three bits of a category name's first letter are a perfect hash
+// over the categories, so finding one costs a single string comparison
+constexpr size_t categorySlot(string_view name)
+{
+    return name.empty() ? 0 : name[0] & 7;
+}
+
+constexpr array<int8_t, 8> categoryTable()
+{
+    array<int8_t, 8> table{};
+    for (auto &entry : table)
+    {
+        entry = -1;
+    }
+    for (size_t i = 0; i < size(CATEGORY_SPECS); i++)
+    {
+        if (table[categorySlot(CATEGORY_SPECS[i].name)] != -1)
+        {
+            throw logic_error("category hash collision");
+        }
+        table[categorySlot(CATEGORY_SPECS[i].name)] = (int8_t)i;
+    }
+    return table;
+}
+
+inline constexpr array<int8_t, 8> CATEGORY_TABLE = categoryTable();
+
+// Index into CATEGORY_SPECS, -1 for an unknown category
+inline int findCategory(string_view name)
+{
+    int8_t category = CATEGORY_TABLE[categorySlot(name)];
+    return category >= 0 && name == CATEGORY_SPECS[category].name ? category : -1;
+}
+
+// Factory class for creating products
+class ProductFactory
+{
+public:
+    // Prompts for a product of the category. Rejected input is reported on
+    // cout and gives NULL.
+    static ProductPtr createProduct(string_view category)
+    {
+        Expected<ProductPtr> created = tryCreateProduct(category);
+        if (!created)
+        {
+            cout << describe(created.error()) << endl;
+            return NULL;
+        }
+        return move(*created);
+    }
+
+    // Same without printing, the error says why the input was rejected
+    static Expected<ProductPtr> tryCreateProduct(string_view category)
+    {
+        int kind = findCategory(category);
+        if (kind < 0)
+        {
+            return OrderError::INVALID_CATEGORY;
+        }
+        const CategorySpec &spec = CATEGORY_SPECS[kind];
+
+        char code;
+        cout << spec.typePrompt;
+        cin >> code;
+
+        string productId;
+        string productName;
+        Money price;
+        cout << "Enter product ID: ";
+        cin >> productId;
+        cout << "Enter product name: ";
+        cin >> productName;
+        cout << "Enter price: ";
+        if (!readPrice(price))
+        {
+            return OrderError::INVALID_PRODUCT;
+        }
+
+        EnteredFields entered;
+        readFields(spec.prompts, entered);
+        int type = ProductTypeRegistry::find(code);
+        if (type < 0 || ProductTypeRegistry::categories[type] != kind)
+        {
+            return spec.invalidType;
+        }
+        readFields(ProductTypeRegistry::prompts[type], entered);
+
+        int id;
+        string_view raw[3];
+        const AttributeSpec *attributes = ProductTypeRegistry::attributes[type];
+        for (int i = 0; i < 3; i++)
+        {
+            raw[i] = entered.find(attributes[i].key);
+        }
+        AttributeValues values;
+        if (!parseNumber(string_view(productId), id) || !ProductTypeRegistry::parseAttributes(type, raw, values))
+        {
+            return OrderError::INVALID_PRODUCT;
+        }
+        return ProductTypeRegistry::create(type, id, productName, price, values);
+    }
+
+    // Loads a whole catalogue file into the inventory without prompting.
+    //
+    // CSV rows are type,product_id,name,price,stock followed by the type
+    // specific columns. The type is the type name or its first letter, any
+    // other value rejects the row:
+    //   Laptop  brand,processor,ram         Mobile  brand,storage,ram
+    //   Chair   material,color,chair_type   Table   material,capacity
+    //   Shirt   size,color,fabric           Jeans   size,color,denim_style
+    // Files ending in .jsonl hold one flat JSON object per line with the same
+    // field names ("name" for the product name). Blank lines, lines starting
+    // with '#' and a CSV header row are skipped. The file is split into
+    // chunks on line boundaries and parsed on several threads.
+    static CatalogueLoadResult loadCatalogue(const string &path, Inventory &inventory,
+                                             unsigned int threads = thread::hardware_concurrency());
+
+    // Builds a product from one parsed row, NULL if the row is malformed
+    static ProductPtr createProduct(const CatalogueRecord &record);
+
+    // Same, the error is INVALID_CATEGORY for an unknown type and
+    // INVALID_PRODUCT for a malformed field
+    static Expected<ProductPtr> tryCreateProduct(const CatalogueRecord &record);
+
+private:
+    // Reads a price such as 499 or 499.99 from cin, false if it is malformed
+    // or negative
+    static bool readPrice(Money &price)
+    {
+        string text;
+        cin >> text;
+        return Money::parse(text, price) && !(price < Money());
+    }
+
+    static bool parseCsvRecord(string_view line, CatalogueRecord &record);
+    static bool parseJsonRecord(string_view line, CatalogueRecord &record);
+    static void parseCatalogueChunk(string_view chunk, bool json, vector<ProductPtr> &products,
+                                    size_t &rejected);
+
+    // Fields typed in on the console, by attribute key
+    struct EnteredFields
+    {
+        const char *keys[4];
+        string values[4];
+        int count = 0;
+
+        string_view find(const char *key) const
+        {
+            for (int i = 0; key != NULL && i < count; i++)
+            {
+                if (strcmp(keys[i], key) == 0)
+                {
+                    return values[i];
+                }
+            }
+            return string_view();
+        }
+    };
+
+    static void readFields(const FieldPrompt *prompts, EnteredFields &entered)
+    {
+        for (int i = 0; i < 2 && prompts[i].key != NULL && entered.count < 4; i++)
+        {
+            cout << prompts[i].text;
+            entered.keys[entered.count] = prompts[i].key;
+            cin >> entered.values[entered.count];
+            entered.count++;
+        }
+    }
+};
+
+// A line of an order request: the product and how many units of it to order
+struct OrderItem
+{
+    Product *product;
+    int quantity;
+};
+
+struct CartLine
+{
+    int productId;
+    int quantity;
+};
+
+// The products a customer is about to order. Adding a product that is
+// already in the cart adds to its quantity, so every product appears once.
+class ShoppingCart
+{
+public:
+    void add(int productId, int quantity)
+    {
+        for (auto &line : cartLines)
+        {
+            if (line.productId == productId)
+            {
+                line.quantity += quantity;
+                return;
+            }
+        }
+        cartLines.push_back(CartLine{productId, quantity});
+    }
+
+    void remove(int productId)
+    {
+        cartLines.erase(remove_if(cartLines.begin(), cartLines.end(), [productId](const CartLine &line)
+                                  { return line.productId == productId; }),
+                        cartLines.end());
+    }
+
+    void clear()
+    {
+        cartLines.clear();
+    }
+
+    const vector<CartLine> &lines() const
+    {
+        return cartLines;
+    }
+
+    size_t size() const
+    {
+        return cartLines.size();
+    }
+
+    bool empty() const
+    {
+        return cartLines.empty();
+    }
+
+private:
+    vector<CartLine> cartLines;
+};
+
+// A set of table rows stored roaring style. Rows are grouped by their high
+// 16 bits into containers. A container holds the low 16 bits as a sorted
+// array while it has at most ARRAY_LIMIT rows, and as a 65536-bit bitmap
+// once it has more, so sparse and dense sets both stay small and
+// intersections work a word or an array element at a time.
+class RowBitmap
+{
+public:
+    void add(uint32_t row)
+    {
+        Container &container = containerFor(row >> 16);
+        uint16_t low = (uint16_t)row;
+        if (container.isBitmap())
+        {
+            uint64_t bit = 1ULL << (low & 63);
+            if ((container.bits[low >> 6] & bit) == 0)
+            {
+                container.bits[low >> 6] |= bit;
+                container.count++;
+            }
+            return;
+        }
+        // Rows mostly arrive in increasing order, so this is usually an append
+        auto it = container.array.empty() || container.array.back() < low
+                      ? container.array.end()
+                      : lower_bound(container.array.begin(), container.array.end(), low);
+        if (it != container.array.end() && *it == low)
+        {
+            return;
+        }
+        container.array.insert(it, low);
+        container.count++;
+        if (container.count > ARRAY_LIMIT)
+        {
+            toBitmap(container);
+        }
+    }
+
+    bool contains(uint32_t row) const
+    {
+        const Container *container = find(row >> 16);
+        if (container == NULL)
+        {
+            return false;
+        }
+        uint16_t low = (uint16_t)row;
+        if (container->isBitmap())
+        {
+            return (container->bits[low >> 6] >> (low & 63)) & 1;
+        }
+        return binary_search(container->array.begin(), container->array.end(), low);
+    }
+
+    size_t cardinality() const
+    {
+        size_t total = 0;
+        for (const auto &container : containers)
+        {
+            total += container.count;
+        }
+        return total;
+    }
+
+    bool empty() const
+    {
+        return containers.empty();
+    }
+
+    RowBitmap intersect(const RowBitmap &other) const
+    {
+        RowBitmap result;
+        size_t i = 0;
+        size_t j = 0;
+        while (i < containers.size() && j < other.containers.size())
+        {
+            const Container &a = containers[i];
+            const Container &b = other.containers[j];
+            if (a.key != b.key)
+            {
+                (a.key < b.key ? i : j)++;
+                continue;
+            }
+            Container both = intersect(a, b);
+            if (both.count > 0)
+            {
+                result.containers.push_back(move(both));
+            }
+            i++;
+            j++;
+        }
+        return result;
+    }
+
+    // Calls visit with every row in increasing order
+    template <typename Visit>
+    void forEach(Visit visit) const
+    {
+        for (const auto &container : containers)
+        {
+            uint32_t high = (uint32_t)container.key << 16;
+            if (!container.isBitmap())
+            {
+                for (uint16_t low : container.array)
+                {
+                    visit(high | low);
+                }
+                continue;
+            }
+            for (size_t word = 0; word < container.bits.size(); word++)
+            {
+                for (uint64_t bits = container.bits[word]; bits != 0; bits &= bits - 1)
+                {
+                    visit(high | (uint32_t)(word * 64 + __builtin_ctzll(bits)));
+                }
+            }
+        }
+    }
+
+private:
+    static const size_t ARRAY_LIMIT = 4096; // 8 KiB as an array, the size of the bitmap
+    static const size_t BITMAP_WORDS = 65536 / 64;
+
+    struct Container
+    {
+        uint16_t key = 0;
+        size_t count = 0;
+        vector<uint16_t> array; // sorted, while the container is sparse
+        vector<uint64_t> bits;  // BITMAP_WORDS words, once it is dense
+
+        bool isBitmap() const
+        {
+            return !bits.empty();
+        }
+    };
+
+    vector<Container> containers; // sorted by key
+
+    const Container *find(uint16_t key) const
+    {
+        auto it = lower_bound(containers.begin(), containers.end(), key, [](const Container &container, uint16_t k)
+                              { return container.key < k; });
+        return it != containers.end() && it->key == key ? &*it : NULL;
+    }
+
+    Container &containerFor(uint32_t key)
+    {
+        if (!containers.empty() && containers.back().key == key)
+        {
+            return containers.back();
+        }
+        auto it = lower_bound(containers.begin(), containers.end(), key, [](const Container &container, uint32_t k)
+                              { return container.key < k; });
+        if (it == containers.end() || it->key != key)
+        {
+            it = containers.insert(it, Container());
+            it->key = (uint16_t)key;
+        }
+        return *it;
+    }
+
+    static void toBitmap(Container &container)
+    {
+        container.bits.assign(BITMAP_WORDS, 0);
+        for (uint16_t low : container.array)
+        {
+            container.bits[low >> 6] |= 1ULL << (low & 63);
+        }
+        container.array = vector<uint16_t>();
+    }
+
+    static Container intersect(const Container &a, const Container &b)
+    {
+        Container result;
+        result.key = a.key;
+        if (a.isBitmap() && b.isBitmap())
+        {
+            result.bits.resize(BITMAP_WORDS);
+            for (size_t word = 0; word < BITMAP_WORDS; word++)
+            {
+                result.bits[word] = a.bits[word] & b.bits[word];
+                result.count += __builtin_popcountll(result.bits[word]);
+            }
+            if (result.count <= ARRAY_LIMIT)
+            {
+                // Back to the compact form
+                for (size_t word = 0; word < BITMAP_WORDS; word++)
+                {
+                    for (uint64_t bits = result.bits[word]; bits != 0; bits &= bits - 1)
+                    {
+                        result.array.push_back((uint16_t)(word * 64 + __builtin_ctzll(bits)));
+                    }
+                }
+                result.bits = vector<uint64_t>();
+            }
+            return result;
+        }
+        if (a.isBitmap() || b.isBitmap())
+        {
+            const Container &sparse = a.isBitmap() ? b : a;
+            const Container &dense = a.isBitmap() ? a : b;
+            for (uint16_t low : sparse.array)
+            {
+                if ((dense.bits[low >> 6] >> (low & 63)) & 1)
+                {
+                    result.array.push_back(low);
+                }
+            }
+        }
+        else
+        {
+            set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                             back_inserter(result.array));
+        }
+        result.count = result.array.size();
+        return result;
+    }
+};
+
+// A faceted catalogue query. Fields left at their defaults match every
+// product; the price range is [minPrice, maxPrice).
+struct ProductQuery
+{
+    int category = -1; // a ProductCategory
+    char type = 0;     // first letter of the concrete class
+    string brand;
+    string material;
+    string color;
+    string size;
+    int ram = 0;
+    int storage = 0;
+    Money minPrice = Money(INT64_MIN);
+    Money maxPrice = Money(INT64_MAX);
+};
+
+// Secondary indexes over the rows of a ProductTable: one RowBitmap per
+// attribute value, and the rows sorted by price for range queries. A query
+// intersects the bitmaps of its facets, smallest first, and applies the
+// price range either by checking the price column of the few survivors or,
+// when many rows are left, by intersecting with the rows of the range.
+//
+// Rows are added as the Inventory adds products. Like the Inventory, adds
+// must not run concurrently with queries; queries may run concurrently.
+class AttributeIndex
+{
+public:
+    void add(const ProductTable &table, uint32_t row)
+    {
+        byCategory[table.categories[row]].add(row);
+        byType[table.types[row]].add(row);
+        if (table.brands[row] != 0)
+        {
+            byBrand[table.brands[row]].add(row);
+        }
+        if (table.materials[row] != 0)
+        {
+            byMaterial[table.materials[row]].add(row);
+        }
+        if (table.colors[row] != 0)
+        {
+            byColor[table.colors[row]].add(row);
+        }
+        if (table.sizes[row] != 0)
+        {
+            bySize[table.sizes[row]].add(row);
+        }
+        if (table.rams[row] != 0)
+        {
+            byRam[table.rams[row]].add(row);
+        }
+        if (table.storages[row] != 0)
+        {
+            byStorage[table.storages[row]].add(row);
+        }
+        unsortedPrices.push_back(PriceEntry{table.prices[row], row});
+    }
+
+    // Rows matching the query, in increasing order
+    vector<uint32_t> query(const ProductTable &table, const ProductQuery &query)
+    {
+        mergePrices();
+
+        // Facets that name a value nobody has match nothing. Strings that
+        // were never interned come back as id 0, which no bitmap is kept for.
+        vector<const RowBitmap *> facets;
+        bool unmatched = false;
+        auto facet = [&](const auto &bitmaps, auto key)
+        {
+            auto it = bitmaps.find(key);
+            if (it == bitmaps.end())
+            {
+                unmatched = true;
+                return;
+            }
+            facets.push_back(&it->second);
+        };
+        if (query.category >= 0)
+        {
+            facet(byCategory, (uint8_t)query.category);
+        }
+        if (query.type != 0)
+        {
+            facet(byType, query.type);
+        }
+        if (!query.brand.empty())
+        {
+            facet(byBrand, table.strings.find(query.brand));
+        }
+        if (!query.material.empty())
+        {
+            facet(byMaterial, table.strings.find(query.material));
+        }
+        if (!query.color.empty())
+        {
+            facet(byColor, table.strings.find(query.color));
+        }
+        if (!query.size.empty())
+        {
+            facet(bySize, table.strings.find(query.size));
+        }
+        if (query.ram != 0)
+        {
+            facet(byRam, query.ram);
+        }
+        if (query.storage != 0)
+        {
+            facet(byStorage, query.storage);
+        }
+
+        vector<uint32_t> rows;
+        if (unmatched)
+        {
+            return rows;
+        }
+
+        // Rows in the price range are a contiguous run of the price index
+        bool priced = query.minPrice.minorUnits != INT64_MIN || query.maxPrice.minorUnits != INT64_MAX;
+        auto first = lower_bound(byPrice.begin(), byPrice.end(), query.minPrice.minorUnits,
+                                 [](const PriceEntry &entry, int64_t price)
+                                 { return entry.price < price; });
+        auto last = lower_bound(first, byPrice.end(), query.maxPrice.minorUnits,
+                                [](const PriceEntry &entry, int64_t price)
+                                { return entry.price < price; });
+
+        if (facets.empty())
+        {
+            for (auto it = first; it != last; ++it)
+            {
+                rows.push_back(it->row);
+            }
+            sort(rows.begin(), rows.end());
+            return rows;
+        }
+
+        sort(facets.begin(), facets.end(), [](const RowBitmap *a, const RowBitmap *b)
+             { return a->cardinality() < b->cardinality(); });
+        RowBitmap matches = *facets[0];
+        for (size_t i = 1; i < facets.size() && !matches.empty(); i++)
+        {
+            matches = matches.intersect(*facets[i]);
+        }
+
+        if (priced && (size_t)(last - first) < matches.cardinality())
+        {
+            // The price range is the narrower filter, intersect with it
+            RowBitmap inRange;
+            vector<uint32_t> rangeRows;
+            for (auto it = first; it != last; ++it)
+            {
+                rangeRows.push_back(it->row);
+            }
+            sort(rangeRows.begin(), rangeRows.end());
+            for (uint32_t row : rangeRows)
+            {
+                inRange.add(row);
+            }
+            matches = matches.intersect(inRange);
+            priced = false;
+        }
+        matches.forEach([&](uint32_t row)
+                        {
+            if (!priced || (table.prices[row] >= query.minPrice.minorUnits && table.prices[row] < query.maxPrice.minorUnits))
+            {
+                rows.push_back(row);
+            } });
+        return rows;
+    }
+
+private:
+    struct PriceEntry
+    {
+        int64_t price;
+        uint32_t row;
+
+        bool operator<(const PriceEntry &other) const
+        {
+            return price != other.price ? price < other.price : row < other.row;
+        }
+    };
+
+    unordered_map<uint8_t, RowBitmap> byCategory;
+    unordered_map<char, RowBitmap> byType;
+    unordered_map<uint32_t, RowBitmap> byBrand; // keyed by interned string id
+    unordered_map<uint32_t, RowBitmap> byMaterial;
+    unordered_map<uint32_t, RowBitmap> byColor;
+    unordered_map<uint32_t, RowBitmap> bySize;
+    unordered_map<int, RowBitmap> byRam;
+    unordered_map<int, RowBitmap> byStorage;
+    vector<PriceEntry> byPrice;        // sorted
+    vector<PriceEntry> unsortedPrices; // added since the last query
+    mutex mergeLock;
+
+    // Sorts the new rows and merges them into the price index, so adding a
+    // whole catalogue costs one sort rather than an insert per row
+    void mergePrices()
+    {
+        lock_guard<mutex> lock(mergeLock);
+        if (unsortedPrices.empty())
+        {
+            return;
+        }
+        sort(unsortedPrices.begin(), unsortedPrices.end());
+        size_t middle = byPrice.size();
+        byPrice.insert(byPrice.end(), unsortedPrices.begin(), unsortedPrices.end());
+        inplace_merge(byPrice.begin(), byPrice.begin() + middle, byPrice.end());
+        unsortedPrices.clear();
+    }
+};
+
+// Search over product names for type-ahead. Names are compared lowercased.
+//
+// Prefix search runs on the names sorted and front coded: every name in a
+// block of BLOCK_SIZE stores only what differs from the one before it, so
+// the sorted copy costs little more than the distinct suffixes. New names go
+// to a small sorted side list first and are merged into the coded blocks
+// once it grows, so adding products keeps the index current without
+// re-encoding it on every add.
+//
+// Typo tolerant search uses trigram postings. An edit is an insert, a delete,
+// a substitution or a swap of neighbouring characters, and changes at most 4
+// trigrams. A name within maxEdits of the query shares all but 4 * maxEdits
+// of the query's trigrams, so the rarest
+// few posting lists are enough to find every candidate, which is then
+// checked with a bounded edit distance. Queries too short to keep a shared
+// trigram are matched by a bounded edit distance scan over the sorted names
+// instead. Both searches return the k matches with the most stock; typo
+// tolerant matches with fewer edits come first.
+//
+// Like AttributeIndex, adds must not run concurrently with searches; searches
+// may run concurrently, the first one after adds merges the side list.
+class NameIndex
+{
+public:
+    void add(uint32_t row, const string &name)
+    {
+        string key = normalize(name);
+        for (size_t i = 0; i + 3 <= key.size(); i++)
+        {
+            vector<uint32_t> &rows = postings[trigram(key, i)];
+            // Rows arrive in increasing order, keep a name's repeated trigrams once
+            if (rows.empty() || rows.back() != row)
+            {
+                rows.push_back(row);
+            }
+        }
+        pending.push_back(Entry{move(key), row});
+        pendingSorted = false;
+    }
+
+    // Rows whose name starts with prefix, most stock first
+    vector<uint32_t> searchPrefix(const ProductTable &table, string_view prefix, size_t k)
+    {
+        prepare();
+        string key = normalize(prefix);
+        TopRows top(table, k);
+        forEachWithPrefix(key, [&top](uint32_t row)
+                          { top.offer(row); });
+        auto it = lower_bound(pending.begin(), pending.end(), key, [](const Entry &entry, const string &value)
+                              { return entry.name < value; });
+        for (; it != pending.end() && it->name.compare(0, key.size(), key) == 0; ++it)
+        {
+            top.offer(it->row);
+        }
+        return top.rows();
+    }
+
+    // Rows whose name starts with text give or take maxEdits typos, most
+    // stock first. nameOf gives the name of a row.
+    vector<uint32_t> searchFuzzy(const ProductTable &table, string_view text, size_t k, int maxEdits,
+                                 const function<string_view(uint32_t)> &nameOf)
+    {
+        string key = normalize(text);
+        int grams = (int)key.size() - 2;
+        int needed = grams - 4 * maxEdits; // trigrams a match must still share
+        if (needed < 1)
+        {
+            return scanFuzzy(table, key, k, maxEdits);
+        }
+
+        // A match misses at most grams - needed of the query's trigrams, so it
+        // is in at least one of the grams - needed + 1 shortest posting lists
+        vector<const vector<uint32_t> *> lists;
+        for (int i = 0; i < grams; i++)
+        {
+            auto it = postings.find(trigram(key, i));
+            lists.push_back(it == postings.end() ? &noRows : &it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t> *a, const vector<uint32_t> *b)
+             { return a->size() < b->size(); });
+        vector<uint32_t> candidates;
+        for (int i = 0; i < grams - needed + 1; i++)
+        {
+            candidates.insert(candidates.end(), lists[i]->begin(), lists[i]->end());
+        }
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+        TopRows top(table, k);
+        PrefixScan scan(key, maxEdits);
+        string name;
+        for (uint32_t row : candidates)
+        {
+            string_view text = nameOf(row);
+            if (text.size() + maxEdits < key.size())
+            {
+                continue;
+            }
+            name.assign(text.data(), text.size());
+            lowercase(name);
+            int distance = scan.distance(name);
+            if (distance <= maxEdits)
+            {
+                top.offer(row, distance);
+            }
+        }
+        return top.rows();
+    }
+
+private:
+    static const size_t BLOCK_SIZE = 16;
+    static const size_t MERGE_AT = 4096; // side list length that triggers a merge
+
+    struct Entry
+    {
+        string name;
+        uint32_t row;
+
+        bool operator<(const Entry &other) const
+        {
+            return name != other.name ? name < other.name : row < other.row;
+        }
+    };
+
+    // Keeps the k best rows offered so far: fewest edits, then most stock
+    class TopRows
+    {
+    public:
+        TopRows(const ProductTable &table, size_t k) : table(table)
+        {
+            this->k = k;
+        }
+
+        void offer(uint32_t row, int distance = 0)
+        {
+            if (k == 0)
+            {
+                return;
+            }
+            Ranked entry{distance, table.stockLevel(row), row};
+            if (heap.size() < k)
+            {
+                heap.push_back(entry);
+                push_heap(heap.begin(), heap.end());
+            }
+            else if (entry < heap.front())
+            {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = entry;
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        vector<uint32_t> rows()
+        {
+            sort(heap.begin(), heap.end());
+            vector<uint32_t> result;
+            for (const auto &entry : heap)
+            {
+                result.push_back(entry.row);
+            }
+            return result;
+        }
+
+    private:
+        struct Ranked
+        {
+            int distance;
+            int stock;
+            uint32_t row;
+
+            // Better entries sort first
+            bool operator<(const Ranked &other) const
+            {
+                if (distance != other.distance)
+                {
+                    return distance < other.distance;
+                }
+                return stock != other.stock ? stock > other.stock : row < other.row;
+            }
+        };
+
+        const ProductTable &table;
+        size_t k;
+        vector<Ranked> heap; // max-heap, the worst kept entry on top
+    };
+
+    // Front coded blocks: per name a varint shared prefix length, a varint
+    // suffix length and the suffix; the first name of a block is whole
+    string coded;
+    vector<uint32_t> blockStarts; // offset of each block in coded
+    vector<string> blockHeads;    // first name of each block, for the binary search
+    vector<uint32_t> codedRows;   // row of each coded name, in name order
+    vector<Entry> pending;        // sorted by prepare()
+    bool pendingSorted = true;
+    mutex prepareLock;
+    unordered_map<uint32_t, vector<uint32_t>> postings; // trigram to increasing rows
+    const vector<uint32_t> noRows;
+
+    static void lowercase(string &text)
+    {
+        for (char &c : text)
+        {
+            c = (char)tolower((unsigned char)c);
+        }
+    }
+
+    static string normalize(string_view text)
+    {
+        string key(text);
+        lowercase(key);
+        return key;
+    }
+
+    static uint32_t trigram(const string &key, size_t at)
+    {
+        return (uint32_t)(unsigned char)key[at] << 16 | (uint32_t)(unsigned char)key[at + 1] << 8 |
+               (unsigned char)key[at + 2];
+    }
+
+    static void putVarint(string &out, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static uint32_t getVarint(const string &in, size_t &at)
+    {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            unsigned char byte = in[at++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            if (byte < 0x80)
+            {
+                return value;
+            }
+        }
+    }
+
+    // Sorts the side list and folds it into the coded blocks once it is long
+    void prepare()
+    {
+        lock_guard<mutex> lock(prepareLock);
+        if (!pendingSorted)
+        {
+            sort(pending.begin(), pending.end());
+            pendingSorted = true;
+        }
+        if (pending.size() < MERGE_AT)
+        {
+            return;
+        }
+        vector<Entry> all;
+        all.reserve(codedRows.size() + pending.size());
+        forEachCoded(0, [&all](const string &name, uint32_t row)
+                     {
+            all.push_back(Entry{name, row});
+            return true; });
+        size_t middle = all.size();
+        move(pending.begin(), pending.end(), back_inserter(all));
+        inplace_merge(all.begin(), all.begin() + middle, all.end());
+        pending.clear();
+
+        coded.clear();
+        blockStarts.clear();
+        blockHeads.clear();
+        codedRows.clear();
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            size_t shared = 0;
+            if (i % BLOCK_SIZE == 0)
+            {
+                blockStarts.push_back((uint32_t)coded.size());
+                blockHeads.push_back(all[i].name);
+            }
+            else
+            {
+                const string &before = all[i - 1].name;
+                while (shared < before.size() && shared < all[i].name.size() && before[shared] == all[i].name[shared])
+                {
+                    shared++;
+                }
+            }
+            putVarint(coded, (uint32_t)shared);
+            putVarint(coded, (uint32_t)(all[i].name.size() - shared));
+            coded.append(all[i].name, shared, string::npos);
+            codedRows.push_back(all[i].row);
+        }
+    }
+
+    // Decodes the coded names from the start of a block onwards, until
+    // visit returns false
+    template <typename Visit>
+    void forEachCoded(size_t block, Visit visit) const
+    {
+        if (block >= blockStarts.size())
+        {
+            return;
+        }
+        string name;
+        size_t at = blockStarts[block];
+        for (size_t i = block * BLOCK_SIZE; i < codedRows.size(); i++)
+        {
+            uint32_t shared = getVarint(coded, at);
+            uint32_t suffix = getVarint(coded, at);
+            name.resize(shared);
+            name.append(coded, at, suffix);
+            at += suffix;
+            if (!visit(name, codedRows[i]))
+            {
+                return;
+            }
+        }
+    }
+
+    template <typename Visit>
+    void forEachWithPrefix(const string &prefix, Visit visit) const
+    {
+        // The last block whose head sorts before the prefix may hold the first match
+        size_t block = lower_bound(blockHeads.begin(), blockHeads.end(), prefix) - blockHeads.begin();
+        forEachCoded(block > 0 ? block - 1 : 0, [&](const string &name, uint32_t row)
+                     {
+            int order = name.compare(0, prefix.size(), prefix);
+            if (order == 0)
+            {
+                visit(row);
+            }
+            return order <= 0; });
+    }
+
+    // Rows of every name within maxEdits of starting with key. The names are
+    // visited in sorted order, so neighbours share the rows of their common
+    // prefix and a prefix already over maxEdits ends the walk down its names.
+    vector<uint32_t> scanFuzzy(const ProductTable &table, const string &key, size_t k, int maxEdits)
+    {
+        prepare();
+        TopRows top(table, k);
+        PrefixScan scan(key, maxEdits);
+        auto offer = [&](const string &name, uint32_t row)
+        {
+            int distance = scan.distance(name);
+            if (distance <= maxEdits)
+            {
+                top.offer(row, distance);
+            }
+        };
+        forEachCoded(0, [&offer](const string &name, uint32_t row)
+                     {
+            offer(name, row);
+            return true; });
+        for (const Entry &entry : pending)
+        {
+            offer(entry.name, entry.row);
+        }
+        return top.rows();
+    }
+
+    // Edit distance between the query and the closest prefix of a name, or
+    // more than limit when that is over limit. Keeps one row per character of
+    // the last name, so the next name recomputes only past their common prefix.
+    class PrefixScan
+    {
+    public:
+        PrefixScan(const string &query, int limit) : query(query)
+        {
+            this->limit = limit;
+            columns = query.size() + 1;
+            cells.resize((query.size() + limit + 1) * columns);
+            for (size_t i = 0; i < columns; i++)
+            {
+                cells[i] = (int)i;
+            }
+            rowMinimum.push_back(0);
+            best.push_back((int)query.size());
+        }
+
+        int distance(const string &name)
+        {
+            size_t shared = 0;
+            while (shared < path.size() && shared < name.size() && path[shared] == name[shared])
+            {
+                shared++;
+            }
+            path.resize(shared);
+            size_t depth = min(name.size(), query.size() + limit);
+            while (path.size() < depth && rowMinimum[path.size()] <= limit)
+            {
+                addRow(name[path.size()]);
+            }
+            return best[path.size()];
+        }
+
+    private:
+        const string &query;
+        int limit;
+        size_t columns;
+        vector<int> cells; // row j, for the first j characters of path, at j * columns
+        vector<int> rowMinimum;
+        vector<int> best; // smallest distance to a prefix of path up to row j
+        string path;
+
+        void addRow(char c)
+        {
+            size_t j = path.size() + 1;
+            const int *previous = &cells[(j - 1) * columns];
+            int *current = &cells[j * columns];
+            current[0] = (int)j;
+            int minimum = current[0];
+            for (size_t i = 1; i < columns; i++)
+            {
+                int substitute = previous[i - 1] + (query[i - 1] != c);
+                current[i] = min(substitute, min(previous[i], current[i - 1]) + 1);
+                if (j > 1 && i > 1 && query[i - 1] == path[j - 2] && query[i - 2] == c)
+                {
+                    current[i] = min(current[i], cells[(j - 2) * columns + i - 2] + 1); // swapped neighbours
+                }
+                minimum = min(minimum, current[i]);
+            }
+            rowMinimum.resize(j);
+            best.resize(j);
+            rowMinimum.push_back(minimum);
+            best.push_back(min(best[j - 1], current[query.size()]));
+            path += c;
+        }
+    };
+};
+
+// Inventory owns every Product in the catalogue and keys it by product_id.
+// Products live in a dense vector; the index is an open-addressing hash table
+// (linear probing) that maps a product_id to its slot in that vector, so stock
+// checks and price lookups take constant time regardless of catalogue size.
+class Inventory
+{
+public:
+    Inventory(size_t expectedProducts = 1024)
+    {
+        products.reserve(expectedProducts);
+        table.reserve(expectedProducts);
+        rehash(expectedProducts * 2);
+        reservedProducts = expectedProducts;
+    }
+
+    // Makes room for expectedProducts without rehashing on the way
+    void reserve(size_t expectedProducts)
+    {
+        products.reserve(expectedProducts);
+        table.reserve(expectedProducts);
+        if (expectedProducts * 2 > index.size())
+        {
+            rehash(expectedProducts * 2);
+        }
+        reservedProducts = max(reservedProducts, expectedProducts);
+    }
+
+    // From now on addProduct never grows the products, the index or the
+    // table, and rejects a product past the reserved room. Call it before
+    // orders run against the inventory, so adds made while they do cannot
+    // move the stock counters under them.
+    void fixCapacity()
+    {
+        capacityFixed = true;
+    }
+
+    // Takes ownership of the product and returns the catalogue entry
+    Product *addProduct(ProductPtr product)
+    {
+        if (product == NULL || findSlot(product->product_id) != EMPTY_SLOT)
+        {
+            throw ProductCreationException();
+        }
+        if (capacityFixed && products.size() >= reservedProducts)
+        {
+            throw InventoryFullException();
+        }
+
+        // Keep the load factor below 1/2 so probe sequences stay short
+        if ((products.size() + 1) * 2 > index.size())
+        {
+            rehash(index.size() * 2);
+        }
+
+        int slot = (int)products.size();
+        insertIndex(product->product_id, slot);
+        addColumns(*product);
+        products.push_back(move(product));
+        return products.back().get();
+    }
+
+    // Returns NULL if no product with this id is in the inventory
+    Product *findProduct(int productId)
+    {
+        int slot = findSlot(productId);
+        if (slot == EMPTY_SLOT)
+        {
+            return NULL;
+        }
+        return products[slot].get();
+    }
+
+    Product &getProduct(int productId)
+    {
+        Product *product = findProduct(productId);
+        if (product == NULL)
+        {
+            throw ProductNotFoundException();
+        }
+        return *product;
+    }
+
+    bool contains(int productId)
+    {
+        return findSlot(productId) != EMPTY_SLOT;
+    }
+
+    bool isOutOfStock(int productId)
+    {
+        return getProduct(productId).isOutOfStock();
+    }
+
+    Money getPrice(int productId)
+    {
+        return getProduct(productId).getPrice();
+    }
+
+    bool reserveStock(int productId, int units)
+    {
+        return getProduct(productId).reserveStock(units);
+    }
+
+    void commitStock(int productId, int units)
+    {
+        getProduct(productId).commitStock(units);
+    }
+
+    void releaseStock(int productId, int units)
+    {
+        getProduct(productId).releaseStock(units);
+    }
+
+    void increaseStock(int productId, int units)
+    {
+        getProduct(productId).increaseStock(units);
+    }
+
+    // Takes units out of stock unconditionally, for replaying recorded sales
+    void decreaseStock(int productId, int units)
+    {
+        getProduct(productId).increaseStock(-units);
+    }
+
+    // Validates the whole cart, then reserves every line or none of them.
+    // Returns the resolved lines, or why the cart was rejected. The stock shards the cart touches are
+    // locked in ascending order, so two baskets can never deadlock and never
+    // each hold part of what the other needs.
+    Expected<vector<OrderItem>> reserveBasket(const ShoppingCart &cart)
+    {
+        Metrics::Timer timer(Metrics::STOCK_RESERVATION_LATENCY);
+        Metrics::count(Metrics::STOCK_RESERVATIONS);
+        vector<OrderItem> items;
+        items.reserve(cart.size());
+        vector<int> shards;
+        for (const auto &line : cart.lines())
+        {
+            if (line.quantity < 0)
+            {
+                return OrderError::NEGATIVE_QUANTITY;
+            }
+            Product *product = findProduct(line.productId);
+            if (product == NULL)
+            {
+                return OrderError::PRODUCT_NOT_FOUND;
+            }
+            items.push_back(OrderItem{product, line.quantity});
+            shards.push_back(product->row % STOCK_SHARDS);
+        }
+        sort(shards.begin(), shards.end());
+        shards.erase(unique(shards.begin(), shards.end()), shards.end());
+
+        for (int shard : shards)
+        {
+            stockShards[shard].lock();
+        }
+        size_t reserved = 0;
+        while (reserved < items.size() && items[reserved].product->reserveStock(items[reserved].quantity))
+        {
+            reserved++;
+        }
+        if (reserved < items.size())
+        {
+            for (size_t i = 0; i < reserved; i++)
+            {
+                items[i].product->releaseStock(items[i].quantity);
+            }
+        }
+        for (auto it = shards.rbegin(); it != shards.rend(); it++)
+        {
+            stockShards[*it].unlock();
+        }
+
+        if (reserved < items.size())
+        {
+            Metrics::count(Metrics::STOCK_SHORTAGES);
+            return OrderError::OUT_OF_STOCK;
+        }
+        return items;
+    }
+
+    // The basket was paid for
+    void commitBasket(const vector<OrderItem> &items)
+    {
+        for (const auto &item : items)
+        {
+            item.product->commitStock(item.quantity);
+        }
+    }
+
+    // The basket was abandoned or its payment failed
+    void releaseBasket(const vector<OrderItem> &items)
+    {
+        for (const auto &item : items)
+        {
+            item.product->releaseStock(item.quantity);
+        }
+    }
+
+    size_t size()
+    {
+        return products.size();
+    }
+
+    // Products in insertion order, slot < size()
+    Product *productAt(size_t slot)
+    {
+        return products[slot].get();
+    }
+
+    // Row r of the table is the product in slot r
+    ProductTable &columns()
+    {
+        return table;
+    }
+
+    // Products matching a faceted query, see AttributeIndex
+    vector<Product *> query(const ProductQuery &query)
+    {
+        return productsAt(attributes.query(table, query));
+    }
+
+    // Up to k products whose name starts with prefix, most stock first
+    vector<Product *> searchByPrefix(string_view prefix, size_t k)
+    {
+        return productsAt(names.searchPrefix(table, prefix, k));
+    }
+
+    // Same, tolerating up to maxEdits typos in text
+    vector<Product *> searchByName(string_view text, size_t k, int maxEdits = 1)
+    {
+        return productsAt(names.searchFuzzy(table, text, k, maxEdits, [this](uint32_t row)
+                                            { return string_view(products[row]->product_name); }));
+    }
+
+private:
+    static const int EMPTY_SLOT = -1;
+    static const int STOCK_SHARDS = 64;
+
+    struct IndexEntry
+    {
+        int productId;
+        int slot;
+    };
+
+    vector<ProductPtr> products;
+    ProductTable table;
+    AttributeIndex attributes;
+    NameIndex names;
+    mutex stockShards[STOCK_SHARDS]; // serialize basket reservations per stock shard
+    vector<IndexEntry> index; // size is always a power of two
+    size_t mask = 0;
+    size_t reservedProducts = 0; // room made by the constructor and reserve()
+    bool capacityFixed = false;
+
+    vector<Product *> productsAt(const vector<uint32_t> &rows)
+    {
+        vector<Product *> found;
+        for (uint32_t row : rows)
+        {
+            found.push_back(products[row].get());
+        }
+        return found;
+    }
+
+    // Copies the hot fields into a new table row and binds the product to it
+    void addColumns(Product &product)
+    {
+        ProductType type = product.productType;
+        uint32_t row = table.append(product.product_id, product.price, product.quantity,
+                                    ProductTypeRegistry::categories[type], ProductTypeRegistry::codes[type]);
+        AttributeValues values;
+        ProductTypeRegistry::read(product, values);
+        const AttributeSpec *specs = ProductTypeRegistry::attributes[type];
+        for (int i = 0; i < 3; i++)
+        {
+            switch (specs[i].column)
+            {
+            case COLUMN_BRAND:
+                table.brands[row] = table.strings.intern(values.text[i]);
+                break;
+            case COLUMN_MATERIAL:
+                table.materials[row] = table.strings.intern(values.text[i]);
+                break;
+            case COLUMN_COLOR:
+                table.colors[row] = table.strings.intern(values.text[i]);
+                break;
+            case COLUMN_SIZE:
+                table.sizes[row] = table.strings.intern(values.text[i]);
+                break;
+            case COLUMN_RAM:
+                table.rams[row] = values.numbers[i];
+                break;
+            case COLUMN_STORAGE:
+                table.storages[row] = values.numbers[i];
+                break;
+            case COLUMN_NONE:
+                break;
+            }
+        }
+        product.table = &table;
+        product.row = row;
+        attributes.add(table, row);
+        names.add(row, product.product_name);
+    }
+
+    static size_t hashId(int productId)
+    {
+        // 32-bit finalizer from MurmurHash3, spreads sequential ids across the table
+        unsigned int h = (unsigned int)productId;
+        h ^= h >> 16;
+        h *= 0x85ebca6bU;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35U;
+        h ^= h >> 16;
+        return h;
+    }
+
+    int findSlot(int productId)
+    {
+        for (size_t i = hashId(productId) & mask;; i = (i + 1) & mask)
+        {
+            if (index[i].slot == EMPTY_SLOT || index[i].productId == productId)
+            {
+                return index[i].slot;
+            }
+        }
+    }
+
+    void insertIndex(int productId, int slot)
+    {
+        size_t i = hashId(productId) & mask;
+        while (index[i].slot != EMPTY_SLOT)
+        {
+            i = (i + 1) & mask;
+        }
+        index[i].productId = productId;
+        index[i].slot = slot;
+    }
+
+    void rehash(size_t minCapacity)
+    {
+        size_t capacity = 16;
+        while (capacity < minCapacity)
+        {
+            capacity *= 2;
+        }
+        index.assign(capacity, IndexEntry{0, EMPTY_SLOT});
+        mask = capacity - 1;
+        for (size_t slot = 0; slot < products.size(); slot++)
+        {
+            insertIndex(products[slot]->product_id, (int)slot);
+        }
+    }
+};
+
+// Batch pricing over packed arrays of unit prices and quantities. Amounts are
+// Money minor units (cents), so every total is exact and independent of the order in
+// which lines are added up. On x86 the line totals are computed with AVX2 when
+// the CPU has it and SSE2 otherwise, other targets use the scalar loop.
+class PricingKernel
+{
+public:
+    // totals[i] = unitCents[i] * quantities[i], quantities must not be negative
+    static void lineTotals(const int64_t *unitCents, const int32_t *quantities, int64_t *totals, size_t count)
+    {
+#ifdef CARTEASE_X86_SIMD
+        static const bool useAvx2 = __builtin_cpu_supports("avx2");
+        if (useAvx2)
+        {
+            lineTotalsAvx2(unitCents, quantities, totals, count);
+            return;
+        }
+        size_t i = lineTotalsSse2(unitCents, quantities, totals, count);
+#else
+        size_t i = 0;
+#endif
+        for (; i < count; i++)
+        {
+            totals[i] = unitCents[i] * quantities[i];
+        }
+    }
+
+    static int64_t sum(const int64_t *values, size_t count)
+    {
+        size_t i = 0;
+        int64_t total = 0;
+#ifdef CARTEASE_X86_SIMD
+        __m128i lanes = _mm_setzero_si128();
+        for (; i + 2 <= count; i += 2)
+        {
+            lanes = _mm_add_epi64(lanes, _mm_loadu_si128((const __m128i *)(values + i)));
+        }
+        int64_t partial[2];
+        _mm_storeu_si128((__m128i *)partial, lanes);
+        total = partial[0] + partial[1];
+#endif
+        for (; i < count; i++)
+        {
+            total += values[i];
+        }
+        return total;
+    }
+
+    // Subtotal of one order
+    static int64_t subtotal(const int64_t *unitCents, const int32_t *quantities, size_t count)
+    {
+        int64_t buffer[64];
+        int64_t total = 0;
+        for (size_t start = 0; start < count; start += 64)
+        {
+            size_t lines = min<size_t>(64, count - start);
+            lineTotals(unitCents + start, quantities + start, buffer, lines);
+            total += sum(buffer, lines);
+        }
+        return total;
+    }
+
+    // Lines of order k are [orderOffsets[k], orderOffsets[k + 1]). Fills
+    // lineCents and orderCents and returns the grand total.
+    static int64_t invoiceTotals(const int64_t *unitCents, const int32_t *quantities, const size_t *orderOffsets,
+                                 size_t orderCount, int64_t *lineCents, int64_t *orderCents)
+    {
+        lineTotals(unitCents, quantities, lineCents, orderOffsets[orderCount]);
+        for (size_t k = 0; k < orderCount; k++)
+        {
+            orderCents[k] = sum(lineCents + orderOffsets[k], orderOffsets[k + 1] - orderOffsets[k]);
+        }
+        return sum(orderCents, orderCount);
+    }
+
+private:
+#ifdef CARTEASE_X86_SIMD
+    // A 64-bit price times a 32-bit quantity from 32x32 bit multiplies:
+    // p * q = lo32(p) * q + (hi32(p) * q << 32), exact modulo 2^64
+    __attribute__((target("avx2"))) static void lineTotalsAvx2(const int64_t *unitCents, const int32_t *quantities,
+                                                               int64_t *totals, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256i price = _mm256_loadu_si256((const __m256i *)(unitCents + i));
+            __m256i quantity = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(quantities + i)));
+            __m256i low = _mm256_mul_epu32(price, quantity);
+            __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(price, 32), quantity);
+            __m256i total = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+            _mm256_storeu_si256((__m256i *)(totals + i), total);
+        }
+        for (; i < count; i++)
+        {
+            totals[i] = unitCents[i] * quantities[i];
+        }
+    }
+
+    // Returns how many lines were done, the caller finishes the tail
+    static size_t lineTotalsSse2(const int64_t *unitCents, const int32_t *quantities, int64_t *totals, size_t count)
+    {
+        size_t i = 0;
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 2 <= count; i += 2)
+        {
+            __m128i price = _mm_loadu_si128((const __m128i *)(unitCents + i));
+            __m128i quantity = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i *)(quantities + i)), zero);
+            __m128i low = _mm_mul_epu32(price, quantity);
+            __m128i high = _mm_mul_epu32(_mm_srli_epi64(price, 32), quantity);
+            _mm_storeu_si128((__m128i *)(totals + i), _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+        }
+        return i;
+    }
+#endif
+};
+
+// Vector that keeps up to N elements inside the object and only allocates
+// once it grows past that. Limited to trivially copyable types, which it
+// copies with memcpy.
+template <typename T, size_t N>
+class SmallVector
+{
+    static_assert(is_trivially_copyable<T>::value, "SmallVector holds trivially copyable types");
+
+public:
+    SmallVector() {}
+    SmallVector(const SmallVector &other)
+    {
+        append(other.data(), other.count);
+    }
+    SmallVector(SmallVector &&other) noexcept
+    {
+        steal(other);
+    }
+    SmallVector &operator=(const SmallVector &other)
+    {
+        if (this != &other)
+        {
+            count = 0;
+            append(other.data(), other.count);
+        }
+        return *this;
+    }
+    SmallVector &operator=(SmallVector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+    ~SmallVector()
+    {
+        release();
+    }
+
+    void push_back(const T &value)
+    {
+        if (count == capacity)
+        {
+            grow(capacity * 2);
+        }
+        data()[count++] = value;
+    }
+
+    void append(const T *values, size_t n)
+    {
+        if (count + n > capacity)
+        {
+            grow(max(capacity * 2, count + n));
+        }
+        if (n > 0)
+        {
+            memcpy((void *)(data() + count), values, n * sizeof(T));
+        }
+        count += n;
+    }
+
+    T *data()
+    {
+        return heap != NULL ? heap : (T *)inlineStorage;
+    }
+    const T *data() const
+    {
+        return heap != NULL ? heap : (const T *)inlineStorage;
+    }
+    size_t size() const
+    {
+        return count;
+    }
+    bool empty() const
+    {
+        return count == 0;
+    }
+    void clear()
+    {
+        count = 0;
+    }
+    T &operator[](size_t i)
+    {
+        return data()[i];
+    }
+    const T &operator[](size_t i) const
+    {
+        return data()[i];
+    }
+    T *begin()
+    {
+        return data();
+    }
+    T *end()
+    {
+        return data() + count;
+    }
+    const T *begin() const
+    {
+        return data();
+    }
+    const T *end() const
+    {
+        return data() + count;
+    }
+
+private:
+    alignas(T) unsigned char inlineStorage[N * sizeof(T)];
+    T *heap = NULL;
+    size_t count = 0;
+    size_t capacity = N;
+
+    void grow(size_t newCapacity)
+    {
+        T *grown = (T *)::operator new(newCapacity * sizeof(T));
+        if (count > 0)
+        {
+            memcpy((void *)grown, data(), count * sizeof(T));
+        }
+        release();
+        heap = grown;
+        capacity = newCapacity;
+    }
+
+    void release()
+    {
+        if (heap != NULL)
+        {
+            ::operator delete(heap);
+            heap = NULL;
+        }
+        capacity = N;
+    }
+
+    void steal(SmallVector &other)
+    {
+        count = other.count;
+        if (other.heap != NULL)
+        {
+            heap = other.heap;
+            capacity = other.capacity;
+            other.heap = NULL;
+            other.capacity = N;
+        }
+        else if (count > 0)
+        {
+            memcpy((void *)inlineStorage, other.inlineStorage, count * sizeof(T));
+        }
+        other.count = 0;
+    }
+};
+
+// A line of a placed order. The unit price is copied from the catalogue when
+// the order is placed, so later price or stock changes do not rewrite it.
+struct LineItem
+{
+    int productId;
+    int quantity;
+    Money unitPrice;
+};
+
+static_assert(is_trivially_copyable<LineItem>::value, "LineItem is copied with memcpy");
+
+// Splits the next comma separated field off the line, without copying
+static string_view nextField(string_view &line)
+{
+    size_t comma = line.find(',');
+    string_view field = line.substr(0, comma);
+    line = comma == string_view::npos ? string_view() : line.substr(comma + 1);
+    return field;
+}
+
+static string_view trimField(string_view field)
+{
+    while (!field.empty() && (field.front() == ' ' || field.front() == '\t'))
+    {
+        field.remove_prefix(1);
+    }
+    while (!field.empty() && (field.back() == ' ' || field.back() == '\t' || field.back() == '\r'))
+    {
+        field.remove_suffix(1);
+    }
+    return field;
+}
+
+bool ProductFactory::parseCsvRecord(string_view line, CatalogueRecord &record)
+{
+    record.type = trimField(nextField(line));
+    record.productId = trimField(nextField(line));
+    record.name = trimField(nextField(line));
+    record.price = trimField(nextField(line));
+    record.stock = trimField(nextField(line));
+    for (auto &attribute : record.attributes)
+    {
+        attribute = trimField(nextField(line));
+    }
+    return !record.stock.empty();
+}
+
+// Reads a flat JSON object of string and number values. Escape sequences are
+// skipped over but left in the value as written.
+bool ProductFactory::parseJsonRecord(string_view line, CatalogueRecord &record)
+{
+    string_view keys[16];
+    string_view values[16];
+    size_t fields = 0;
+    size_t pos = line.find('{');
+    while (pos != string_view::npos && fields < 16)
+    {
+        size_t keyStart = line.find('"', pos + 1);
+        if (keyStart == string_view::npos)
+        {
+            break;
+        }
+        size_t keyEnd = line.find('"', keyStart + 1);
+        size_t colon = keyEnd == string_view::npos ? keyEnd : line.find(':', keyEnd + 1);
+        if (colon == string_view::npos)
+        {
+            return false;
+        }
+        size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+        if (valueStart == string_view::npos)
+        {
+            return false;
+        }
+        size_t valueEnd;
+        if (line[valueStart] == '"')
+        {
+            valueStart++;
+            valueEnd = valueStart;
+            while (valueEnd < line.size() && line[valueEnd] != '"')
+            {
+                valueEnd += line[valueEnd] == '\\' ? 2 : 1;
+            }
+            if (valueEnd >= line.size())
+            {
+                return false;
+            }
+            pos = line.find_first_of(",}", valueEnd + 1);
+        }
+        else
+        {
+            valueEnd = line.find_first_of(",}", valueStart);
+            pos = valueEnd;
+        }
+        keys[fields] = line.substr(keyStart + 1, keyEnd - keyStart - 1);
+        values[fields] = trimField(line.substr(valueStart, valueEnd - valueStart));
+        fields++;
+        if (pos != string_view::npos && line[pos] == '}')
+        {
+            break;
+        }
+    }
+
+    auto lookup = [&](string_view key)
+    {
+        for (size_t i = 0; i < fields; i++)
+        {
+            if (keys[i] == key)
+            {
+                return values[i];
+            }
+        }
+        return string_view();
+    };
+
+    record.type = lookup("type");
+    record.productId = lookup("product_id");
+    record.name = lookup("name");
+    record.price = lookup("price");
+    record.stock = lookup("stock");
+    int type = ProductTypeRegistry::find(record.type);
+    if (type < 0)
+    {
+        return false;
+    }
+    const AttributeSpec *attributes = ProductTypeRegistry::attributes[type];
+    for (size_t i = 0; i < 3; i++)
+    {
+        record.attributes[i] = attributes[i].key != NULL ? lookup(attributes[i].key) : string_view();
+    }
+    return true;
+}
+
+ProductPtr ProductFactory::createProduct(const CatalogueRecord &record)
+{
+    Expected<ProductPtr> product = tryCreateProduct(record);
+    return product ? move(*product) : NULL;
+}
+
+Expected<ProductPtr> ProductFactory::tryCreateProduct(const CatalogueRecord &record)
+{
+    int type = ProductTypeRegistry::find(record.type);
+    if (type < 0)
+    {
+        return OrderError::INVALID_CATEGORY;
+    }
+
+    int productId;
+    Money price;
+    int stock;
+    AttributeValues values;
+    if (!parseNumber(record.productId, productId) || !Money::parse(record.price, price) ||
+        !parseNumber(record.stock, stock) || price < Money() || stock < 0 ||
+        !ProductTypeRegistry::parseAttributes(type, record.attributes, values))
+    {
+        return OrderError::INVALID_PRODUCT;
+    }
+    ProductPtr product = ProductTypeRegistry::create(type, productId, string(record.name), price, values);
+    product->quantity = stock;
+    return product;
+}
+
+void ProductFactory::parseCatalogueChunk(string_view chunk, bool json, vector<ProductPtr> &products,
+                                         size_t &rejected)
+{
+    while (!chunk.empty())
+    {
+        size_t newline = chunk.find('\n');
+        string_view line = trimField(chunk.substr(0, newline));
+        chunk = newline == string_view::npos ? string_view() : chunk.substr(newline + 1);
+        if (line.empty() || line[0] == '#' || (!json && line.substr(0, 4) == "type"))
+        {
+            continue;
+        }
+
+        CatalogueRecord record;
+        bool parsed = json ? parseJsonRecord(line, record) : parseCsvRecord(line, record);
+        ProductPtr product = parsed ? createProduct(record) : NULL;
+        if (product == NULL)
+        {
+            rejected++;
+            continue;
+        }
+        products.push_back(move(product));
+    }
+}
+
+CatalogueLoadResult ProductFactory::loadCatalogue(const string &path, Inventory &inventory, unsigned int threads)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        throw ProductCreationException();
+    }
+    string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    string_view data(contents);
+    bool json = path.size() >= 6 && path.compare(path.size() - 6, 6, ".jsonl") == 0;
+
+    // Cut the file into roughly equal chunks that end on a line boundary
+    threads = max(1u, min(threads, (unsigned int)(data.size() / (64 * 1024) + 1)));
+    vector<string_view> chunks;
+    size_t start = 0;
+    for (unsigned int i = 0; i < threads && start < data.size(); i++)
+    {
+        size_t end = i + 1 == threads ? data.size() : data.find('\n', max(start, data.size() * (i + 1) / threads));
+        end = end == string_view::npos ? data.size() : end + 1;
+        chunks.push_back(data.substr(start, end - start));
+        start = end;
+    }
+
+    vector<vector<ProductPtr>> parsed(chunks.size());
+    vector<size_t> rejected(chunks.size(), 0);
+    vector<thread> workers;
+    for (size_t i = 1; i < chunks.size(); i++)
+    {
+        workers.emplace_back(parseCatalogueChunk, chunks[i], json, ref(parsed[i]), ref(rejected[i]));
+    }
+    if (!chunks.empty())
+    {
+        parseCatalogueChunk(chunks[0], json, parsed[0], rejected[0]);
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    CatalogueLoadResult result;
+    size_t total = 0;
+    for (auto &products : parsed)
+    {
+        total += products.size();
+    }
+    inventory.reserve(inventory.size() + total);
+    for (size_t i = 0; i < parsed.size(); i++)
+    {
+        result.rejected += rejected[i];
+        for (auto &product : parsed[i])
+        {
+            if (inventory.contains(product->product_id))
+            {
+                result.rejected++;
+                continue;
+            }
+            inventory.addProduct(move(product));
+            result.loaded++;
+        }
+    }
+    return result;
+}
+
+// On-disk layout of a catalogue snapshot (little endian, fixed size records):
+//
+//   SnapshotHeader | SnapshotRecord[count] sorted by productId | string pool
+//
+// Strings are stored once in the pool and referenced by offset and length.
+// Bump SNAPSHOT_VERSION whenever any of these structs change.
+const uint32_t SNAPSHOT_VERSION = 2;
+const char SNAPSHOT_MAGIC[8] = {'C', 'A', 'R', 'T', 'S', 'N', 'A', 'P'};
+
+struct SnapshotString
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+// type is the ProductTraits code. The type's attributes are stored in the
+// order of ProductTraits::attributes, text ones in text and numeric ones in
+// numbers:
+//   Laptop  text: brand, processor             numbers: ram
+//   Mobile  text: brand                        numbers: storage, ram
+//   Chair   text: material, color, chair_type
+//   Table   text: material                     numbers: capacity
+//   Shirt   text: size, color, fabric
+//   Jeans   text: size, color, denim_style
+struct SnapshotRecord
+{
+    int32_t productId;
+    char type;
+    char padding[3];
+    int32_t quantity;
+    int32_t numbers[2];
+    int64_t price; // minor units, see Money
+    SnapshotString name;
+    SnapshotString text[3];
+};
+
+// Makes a rename or unlink in the file's directory durable
+inline bool syncDirectoryOf(const string &path)
+{
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+// A catalogue snapshot mapped read-only into memory. Lookups binary search
+// the mapped records and strings are returned as views into the mapping, so
+// opening a snapshot costs one mmap no matter how large the catalogue is.
+class MappedCatalogue
+{
+public:
+    MappedCatalogue(const string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw SnapshotException();
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader))
+        {
+            close(fd);
+            throw SnapshotException();
+        }
+        mappedSize = info.st_size;
+        void *mapped = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            throw SnapshotException();
+        }
+        base = (const char *)mapped;
+
+        // The count is bounded by the file size before it is multiplied, so a
+        // corrupt header cannot wrap the offsets around into range
+        const SnapshotHeader *header = (const SnapshotHeader *)base;
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header->version != SNAPSHOT_VERSION || header->recordSize != sizeof(SnapshotRecord) ||
+            header->count > (mappedSize - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord) ||
+            header->stringsOffset != sizeof(SnapshotHeader) + header->count * sizeof(SnapshotRecord) ||
+            header->stringsSize != mappedSize - header->stringsOffset)
+        {
+            munmap((void *)base, mappedSize);
+            throw SnapshotException();
+        }
+        records = (const SnapshotRecord *)(base + sizeof(SnapshotHeader));
+        count = header->count;
+        strings = base + header->stringsOffset;
+        stringsSize = header->stringsSize;
+    }
+
+    ~MappedCatalogue()
+    {
+        munmap((void *)base, mappedSize);
+    }
+
+    MappedCatalogue(const MappedCatalogue &) = delete;
+    MappedCatalogue &operator=(const MappedCatalogue &) = delete;
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    const SnapshotRecord &recordAt(size_t i) const
+    {
+        return records[i];
+    }
+
+    // Returns NULL if the snapshot holds no product with this id
+    const SnapshotRecord *find(int productId) const
+    {
+        const SnapshotRecord *end = records + count;
+        const SnapshotRecord *it = lower_bound(records, end, productId, [](const SnapshotRecord &record, int id)
+                                               { return record.productId < id; });
+        if (it == end || it->productId != productId)
+        {
+            return NULL;
+        }
+        return it;
+    }
+
+    string_view text(SnapshotString ref) const
+    {
+        if ((uint64_t)ref.offset + ref.length > stringsSize)
+        {
+            return string_view();
+        }
+        return string_view(strings + ref.offset, ref.length);
+    }
+
+    // Builds a heap Product from a record, for products that are about to be
+    // ordered and so need to live in the Inventory
+    ProductPtr materialize(const SnapshotRecord &record) const
+    {
+        int type = ProductTypeRegistry::find(record.type);
+        if (type < 0 || record.price < 0 || record.quantity < 0)
+        {
+            return NULL;
+        }
+        AttributeValues values;
+        const AttributeSpec *attributes = ProductTypeRegistry::attributes[type];
+        int texts = 0;
+        int numbers = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (attributes[i].key == NULL)
+            {
+                continue;
+            }
+            if (attributes[i].numeric)
+            {
+                values.numbers[i] = numbers < 2 ? record.numbers[numbers++] : 0;
+            }
+            else
+            {
+                values.text[i] = texts < 3 ? text(record.text[texts++]) : string_view();
+            }
+        }
+        ProductPtr product = ProductTypeRegistry::create(type, record.productId, string(text(record.name)),
+                                                         Money(record.price), values);
+        product->quantity = record.quantity;
+        return product;
+    }
+
+    // Writes every product in the inventory as a snapshot. The file is
+    // written next to the target, synced and renamed into place, and the
+    // directory is synced, so a crash never leaves a half written snapshot
+    // behind.
+    static void write(Inventory &inventory, const string &path)
+    {
+        vector<SnapshotRecord> output;
+        output.reserve(inventory.size());
+        string pool;
+        auto intern = [&pool](string_view value)
+        {
+            SnapshotString ref{(uint32_t)pool.size(), (uint32_t)value.size()};
+            pool += value;
+            return ref;
+        };
+
+        for (size_t slot = 0; slot < inventory.size(); slot++)
+        {
+            Product *product = inventory.productAt(slot);
+            SnapshotRecord record;
+            memset(&record, 0, sizeof(record));
+            record.productId = product->product_id;
+            record.quantity = product->stockLevel();
+            record.price = product->getPrice().minorUnits;
+            record.name = intern(product->product_name);
+            record.type = ProductTypeRegistry::codes[product->productType];
+            AttributeValues values;
+            ProductTypeRegistry::read(*product, values);
+            const AttributeSpec *attributes = ProductTypeRegistry::attributes[product->productType];
+            int texts = 0;
+            int numbers = 0;
+            for (int i = 0; i < 3; i++)
+            {
+                if (attributes[i].key == NULL)
+                {
+                    continue;
+                }
+                if (attributes[i].numeric && numbers < 2)
+                {
+                    record.numbers[numbers++] = values.numbers[i];
+                }
+                else if (!attributes[i].numeric && texts < 3)
+                {
+                    record.text[texts++] = intern(values.text[i]);
+                }
+            }
+            output.push_back(record);
+        }
+        sort(output.begin(), output.end(), [](const SnapshotRecord &a, const SnapshotRecord &b)
+             { return a.productId < b.productId; });
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.recordSize = sizeof(SnapshotRecord);
+        header.count = output.size();
+        header.stringsOffset = sizeof(SnapshotHeader) + output.size() * sizeof(SnapshotRecord);
+        header.stringsSize = pool.size();
+
+        string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw SnapshotException();
+        }
+        bool written = writeAll(fd, string_view((const char *)&header, sizeof(header))) &&
+                       writeAll(fd, string_view((const char *)output.data(), output.size() * sizeof(SnapshotRecord))) &&
+                       writeAll(fd, pool) && fsync(fd) == 0;
+        close(fd);
+        if (!written || rename(temporary.c_str(), path.c_str()) != 0 || !syncDirectoryOf(path))
+        {
+            throw SnapshotException();
+        }
+    }
+
+private:
+    static bool writeAll(int fd, string_view data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            written += n > 0 ? n : 0;
+        }
+        return true;
+    }
+
+    const char *base = NULL;
+    size_t mappedSize = 0;
+    const SnapshotRecord *records = NULL;
+    size_t count = 0;
+    const char *strings = NULL;
+    size_t stringsSize = 0;
+};
+
+// Products held by value in one contiguous array, for batch work over a
+// whole catalogue. After group() the products of each type form a single
+// run, and visit() calls the visitor with the concrete type once per run
+// rather than once per product. The per-product calls then resolve at
+// compile time (the concrete classes are final) and stay inlined and
+// predictable. Copies of inventory products still read price and stock
+// through the inventory's table.
+class ProductSheet
+{
+public:
+    void reserve(size_t products)
+    {
+        items.reserve(products);
+    }
+
+    void add(const Product &product)
+    {
+        items.push_back(ProductTypeRegistry::copy(product));
+        grouped = false;
+    }
+
+    void add(ProductValue product)
+    {
+        items.push_back(move(product));
+        grouped = false;
+    }
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    // Orders the products by type, keeping their order within a type
+    void group()
+    {
+        if (!grouped)
+        {
+            stable_sort(items.begin(), items.end(), [](const ProductValue &a, const ProductValue &b)
+                        { return a.index() < b.index(); });
+            grouped = true;
+        }
+    }
+
+    // Calls visitor(T &) for every product, one run of a type at a time
+    template <typename Visitor>
+    void visit(Visitor &&visitor)
+    {
+        size_t begin = 0;
+        while (begin < items.size())
+        {
+            size_t end = begin + 1;
+            while (end < items.size() && items[end].index() == items[begin].index())
+            {
+                end++;
+            }
+            std::visit([&](auto &first)
+                       { visitRun<decay_t<decltype(first)>>(begin, end, visitor); },
+                       items[begin]);
+            begin = end;
+        }
+    }
+
+    // Writes the details of every product, grouped by type, with a blank
+    // line after each product
+    void writeDetails(ReportBuffer &out)
+    {
+        group();
+        visit([&out](auto &product)
+              {
+            product.writeDetails(out);
+            out << '\n'; });
+    }
+
+    static ProductSheet fromInventory(Inventory &inventory);
+
+private:
+    vector<ProductValue> items;
+    bool grouped = true;
+
+    template <typename T, typename Visitor>
+    void visitRun(size_t begin, size_t end, Visitor &visitor)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            visitor(*get_if<T>(&items[i]));
+        }
+    }
+};
+
+ProductSheet ProductSheet::fromInventory(Inventory &inventory)
+{
+    ProductSheet sheet;
+    sheet.reserve(inventory.size());
+    for (size_t slot = 0; slot < inventory.size(); slot++)
+    {
+        sheet.add(*inventory.productAt(slot));
+    }
+    sheet.group();
+    return sheet;
+}
+
+class Order
+{
+public:
+    uint64_t orderId;
+    int custid = 0; // customer who placed the order
+    bool isPaid;
+    bool isCancelled = false;       // Initialize to false by default
+    SmallVector<LineItem, 4> items; // Order has line items, typical baskets fit inline
+
+    Order()
+    {
+        orderId = 0;
+        isPaid = false;
+    }
+    Order(uint64_t orderId, bool isPaid)
+    {
+        this->orderId = orderId;
+        this->isPaid = isPaid;
+    }
+
+    // Adds a line priced at the product's current price
+    void addProduct(Product *product, int quantity)
+    {
+        items.push_back(LineItem{product->product_id, quantity, product->getPrice()});
+    }
+};
+
+struct OrderDeleter
+{
+    void operator()(Order *order) const;
+};
+
+typedef unique_ptr<Order, OrderDeleter> OrderPtr;
+
+// Process-wide registry of placed orders. It owns every Order and hands out
+// order ids.
+//
+// Ids are 64-bit: the top 16 bits carry a node id so several processes can
+// issue ids without clashing, the rest is a sequence handed to each thread in
+// blocks, so the hot path only touches thread-local state. Ids are monotonic
+// per thread. Orders are kept in a sharded map keyed by id, so a lookup only
+// locks one shard and does not need to know which Customer placed the order.
+class OrderRegistry
+{
+public:
+    static OrderRegistry &instance()
+    {
+        static OrderRegistry registry;
+        return registry;
+    }
+
+    // Must be called before the first id is handed out
+    void setNodeId(uint16_t nodeId)
+    {
+        this->nodeId = nodeId;
+    }
+
+    // Makes sure ids handed out from now on are above orderId, used when
+    // orders are recovered at startup
+    void reserveIdsThrough(uint64_t orderId)
+    {
+        uint64_t sequence = (orderId & ((1ULL << NODE_SHIFT) - 1)) + 1;
+        uint64_t cursor = blockCursor.load();
+        while (cursor < sequence && !blockCursor.compare_exchange_weak(cursor, sequence))
+        {
+        }
+    }
+
+    uint64_t nextOrderId()
+    {
+        thread_local uint64_t next = 0;
+        thread_local uint64_t end = 0;
+        if (next == end)
+        {
+            next = blockCursor.fetch_add(ID_BLOCK_SIZE, memory_order_relaxed);
+            end = next + ID_BLOCK_SIZE;
+        }
+        return ((uint64_t)nodeId << NODE_SHIFT) | next++;
+    }
+
+    // Orders are allocated from the registry's pool, an OrderPtr gives the
+    // slot back when it is destroyed without being registered
+    OrderPtr createOrder(uint64_t orderId)
+    {
+        return OrderPtr(orderPool.create(orderId, false));
+    }
+
+    void destroyOrder(Order *order)
+    {
+        orderPool.destroy(order);
+    }
+
+    // Takes ownership of the order, returns the registered entry
+    Order *registerOrder(OrderPtr order)
+    {
+        Shard &shard = shardFor(order->orderId);
+        lock_guard<mutex> lock(shard.lock);
+        Order *registered = order.get();
+        shard.orders[order->orderId] = move(order);
+        return registered;
+    }
+
+    // Destroys a registered order, for history that was paged out
+    void releaseOrder(uint64_t orderId)
+    {
+        Shard &shard = shardFor(orderId);
+        lock_guard<mutex> lock(shard.lock);
+        shard.orders.erase(orderId);
+    }
+
+    // Returns NULL if no order with this id was registered
+    Order *findOrder(uint64_t orderId)
+    {
+        Shard &shard = shardFor(orderId);
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.orders.find(orderId);
+        if (it == shard.orders.end())
+        {
+            return NULL;
+        }
+        return it->second.get();
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+        for (auto &shard : shards)
+        {
+            lock_guard<mutex> lock(shard.lock);
+            total += shard.orders.size();
+        }
+        return total;
+    }
+
+private:
+    static const int SHARD_COUNT = 64;
+    static const int NODE_SHIFT = 48;
+    static const uint64_t ID_BLOCK_SIZE = 1024;
+
+    // Each shard sits on its own cache line so threads working on different
+    // shards do not contend
+    struct alignas(64) Shard
+    {
+        mutex lock;
+        unordered_map<uint64_t, OrderPtr> orders;
+    };
+
+    ObjectPool<Order> orderPool; // declared first, so it outlives the shards
+    Shard shards[SHARD_COUNT];
+    atomic<uint64_t> blockCursor{1};
+    uint16_t nodeId = 0;
+
+    OrderRegistry() {}
+
+    Shard &shardFor(uint64_t orderId)
+    {
+        // Ids come out sequentially, so the low bits spread them evenly
+        return shards[orderId % SHARD_COUNT];
+    }
+};
+
+void OrderDeleter::operator()(Order *order) const
+{
+    OrderRegistry::instance().destroyOrder(order);
+}
+// A payment authorization waiting to be sent to the gateway
+struct PaymentRequest
+{
+    uint64_t orderId;
+    Money amount;
+    function<void(bool)> onComplete; // called with the authorization result
+    chrono::steady_clock::time_point enqueuedAt;
+};
+
+// The remote side of the payment gateway. One call authorizes a whole batch
+// and returns one result per request, in order.
+class PaymentBackend
+{
+public:
+    virtual ~PaymentBackend() {}
+    virtual vector<bool> authorizeBatch(const vector<PaymentRequest> &batch) = 0;
+};
+
+// In-process stand-in for a real gateway, for tests and local runs. Every
+// batch takes the configured round trip latency and each authorization fails
+// with the configured probability.
+class SimulatedPaymentBackend : public PaymentBackend
+{
+public:
+    SimulatedPaymentBackend(chrono::microseconds latency = chrono::microseconds(0), double failureRate = 0.0,
+                            unsigned int seed = 42)
+        : rng(seed)
+    {
+        this->latency = latency;
+        this->failureRate = failureRate;
+    }
+
+    vector<bool> authorizeBatch(const vector<PaymentRequest> &batch) override
+    {
+        if (latency.count() > 0)
+        {
+            this_thread::sleep_for(latency);
+        }
+        vector<bool> results(batch.size(), true);
+        if (failureRate > 0.0)
+        {
+            lock_guard<mutex> lock(rngLock);
+            uniform_real_distribution<double> draw(0.0, 1.0);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                results[i] = draw(rng) >= failureRate;
+            }
+        }
+        return results;
+    }
+
+private:
+    chrono::microseconds latency;
+    double failureRate;
+    mt19937 rng;
+    mutex rngLock;
+};
+
+// Asynchronous payment gateway. Authorizations are queued and sent to the
+// backend in batches of up to batchSize requests; a partial batch waits at
+// most linger for more requests before it is sent. Several batches can be in
+// flight at once, one per dispatcher thread, so callers can pipeline many
+// payments instead of blocking on each round trip.
+class PaymentGateway
+{
+public:
+    PaymentGateway(size_t batchSize = 64, chrono::microseconds linger = chrono::microseconds(200),
+                   size_t dispatchers = 4, unique_ptr<PaymentBackend> backend = NULL)
+    {
+        this->batchSize = max<size_t>(batchSize, 1);
+        this->linger = linger;
+        this->backend = backend != NULL ? move(backend) : make_unique<SimulatedPaymentBackend>();
+        for (size_t i = 0; i < max<size_t>(dispatchers, 1); i++)
+        {
+            workers.emplace_back(&PaymentGateway::dispatch, this);
+        }
+    }
+
+    ~PaymentGateway()
+    {
+        stop();
+    }
+
+    // Queues an authorization, onComplete runs on a dispatcher thread
+    void submitPayment(uint64_t orderId, Money amount, function<void(bool)> onComplete)
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            if (stopping)
+            {
+                throw PaymentProcessingException();
+            }
+            pending.push_back(PaymentRequest{orderId, amount, move(onComplete), chrono::steady_clock::now()});
+        }
+        queueReady.notify_one();
+    }
+
+    future<bool> submitPayment(uint64_t orderId, Money amount)
+    {
+        auto result = make_shared<promise<bool>>();
+        submitPayment(orderId, amount, [result](bool paid)
+                      { result->set_value(paid); });
+        return result->get_future();
+    }
+
+    // Blocks for the full round trip
+    bool processPayment(uint64_t orderId, Money amount)
+    {
+        return submitPayment(orderId, amount).get();
+    }
+
+    // Sends whatever is still queued, then stops the dispatchers
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (auto &worker : workers)
+        {
+            if (worker.joinable())
+            {
+                worker.join();
+            }
+        }
+    }
+
+private:
+    size_t batchSize;
+    chrono::microseconds linger;
+    unique_ptr<PaymentBackend> backend;
+    deque<PaymentRequest> pending;
+    bool stopping = false;
+    mutex queueLock;
+    condition_variable queueReady;
+    vector<thread> workers;
+
+    void dispatch()
+    {
+        unique_lock<mutex> lock(queueLock);
+        while (true)
+        {
+            queueReady.wait(lock, [this]
+                            { return stopping || !pending.empty(); });
+            if (pending.empty())
+            {
+                return; // stopping and drained
+            }
+
+            // Give a partial batch up to linger to fill up
+            auto deadline = pending.front().enqueuedAt + linger;
+            queueReady.wait_until(lock, deadline, [this]
+                                  { return stopping || pending.size() >= batchSize; });
+            size_t count = min(batchSize, pending.size());
+            if (count == 0)
+            {
+                continue; // another dispatcher took the batch
+            }
+            vector<PaymentRequest> batch(make_move_iterator(pending.begin()), make_move_iterator(pending.begin() + count));
+            pending.erase(pending.begin(), pending.begin() + count);
+            lock.unlock();
+
+            vector<bool> results;
+            try
+            {
+                results = backend->authorizeBatch(batch);
+            }
+            catch (exception &ex)
+            {
+                results.clear();
+            }
+            results.resize(batch.size(), false); // a failed round trip declines the whole batch
+            Metrics::count(Metrics::PAYMENT_BATCHES);
+            auto answered = chrono::steady_clock::now();
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                Metrics::count(results[i] ? Metrics::PAYMENTS_AUTHORIZED : Metrics::PAYMENTS_DECLINED);
+                Metrics::record(Metrics::PAYMENT_LATENCY, answered - batch[i].enqueuedAt);
+                batch[i].onComplete(results[i]);
+            }
+            lock.lock();
+        }
+    }
+};
+
+// Scratch file that order history is paged out to. Segments are appended as
+// encoded blocks and read back by offset. The journal, not this file, is the
+// durable record, so it starts empty on every run.
+class OrderArchive
+{
+public:
+    OrderArchive(const string &path)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw HistoryPagingException();
+        }
+    }
+
+    ~OrderArchive()
+    {
+        close(fd);
+    }
+
+    OrderArchive(const OrderArchive &) = delete;
+    OrderArchive &operator=(const OrderArchive &) = delete;
+
+    // Returns the offset the block was stored at
+    uint64_t store(const string &block)
+    {
+        uint64_t offset = end.fetch_add(block.size());
+        size_t written = 0;
+        while (written < block.size())
+        {
+            ssize_t n = pwrite(fd, block.data() + written, block.size() - written, offset + written);
+            if (n < 0 && errno != EINTR)
+            {
+                throw HistoryPagingException();
+            }
+            written += n > 0 ? n : 0;
+        }
+        return offset;
+    }
+
+    string load(uint64_t offset, size_t length)
+    {
+        string block(length, '\0');
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t n = pread(fd, &block[done], length - done, offset + done);
+            if (n <= 0 && errno != EINTR)
+            {
+                throw HistoryPagingException();
+            }
+            done += n > 0 ? n : 0;
+        }
+        return block;
+    }
+
+    static void encode(const Order &order, string &out)
+    {
+        put(out, order.orderId);
+        put(out, (int32_t)order.custid);
+        put(out, (uint8_t)((order.isPaid ? 1 : 0) | (order.isCancelled ? 2 : 0)));
+        put(out, (uint32_t)order.items.size());
+        for (const auto &item : order.items)
+        {
+            put(out, (int32_t)item.productId);
+            put(out, (int32_t)item.quantity);
+            put(out, item.unitPrice.minorUnits);
+        }
+    }
+
+    // Reads the order starting at at into order, which must have no lines yet
+    static void decode(string_view block, size_t &at, Order &order)
+    {
+        order.orderId = get<uint64_t>(block, at);
+        order.custid = get<int32_t>(block, at);
+        uint8_t flags = get<uint8_t>(block, at);
+        order.isPaid = (flags & 1) != 0;
+        order.isCancelled = (flags & 2) != 0;
+        uint32_t lines = get<uint32_t>(block, at);
+        for (uint32_t i = 0; i < lines && at < block.size(); i++)
+        {
+            LineItem item;
+            item.productId = get<int32_t>(block, at);
+            item.quantity = get<int32_t>(block, at);
+            item.unitPrice = Money(get<int64_t>(block, at));
+            order.items.push_back(item);
+        }
+    }
+
+private:
+    int fd;
+    atomic<uint64_t> end{0};
+
+    template <typename T>
+    static void put(string &out, T value)
+    {
+        out.append((const char *)&value, sizeof(value));
+    }
+
+    template <typename T>
+    static T get(string_view block, size_t &at)
+    {
+        T value = T();
+        if (at + sizeof(T) <= block.size())
+        {
+            memcpy(&value, block.data() + at, sizeof(T));
+        }
+        at += sizeof(T);
+        return value;
+    }
+};
+
+// Order history of one customer. Orders sit in fixed size segments, so an
+// append never moves or copies the orders already there. Full segments
+// other than the newest ones can be paged out to an OrderArchive: their
+// Orders are released from the registry and only their ids stay in memory
+// until the segment is touched again.
+//
+// An order is located by segment * SEGMENT_SIZE + slot. Not synchronized,
+// the owning Customer locks around it.
+class OrderHistory
+{
+public:
+    static const size_t SEGMENT_SIZE = 64;
+
+    // Orders held, cancelled ones included
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t append(Order *order)
+    {
+        if (segments.empty() || segments.back()->used == SEGMENT_SIZE || segments.back()->paged)
+        {
+            segments.push_back(make_unique<Segment>());
+        }
+        Segment &segment = *segments.back();
+        segment.orders[segment.used] = order;
+        count++;
+        return (segments.size() - 1) * SEGMENT_SIZE + segment.used++;
+    }
+
+    // Pages the segment back in if needed
+    Order *at(size_t location)
+    {
+        Segment &segment = *segments[location / SEGMENT_SIZE];
+        if (segment.paged)
+        {
+            pageIn(segment);
+        }
+        return segment.orders[location % SEGMENT_SIZE];
+    }
+
+    // To be called after changing the order at location, its segment is
+    // stored to the archive again on the next page out
+    void changed(size_t location)
+    {
+        segments[location / SEGMENT_SIZE]->dirty = true;
+    }
+
+    // Visits every order in history order. Paged out orders are decoded into
+    // a temporary for the visit and stay paged out.
+    void forEach(const function<void(const Order &)> &visit) const
+    {
+        for (const auto &segment : segments)
+        {
+            if (!segment->paged)
+            {
+                for (size_t slot = 0; slot < segment->used; slot++)
+                {
+                    visit(*segment->orders[slot]);
+                }
+                continue;
+            }
+            string block = segment->archive->load(segment->offset, segment->length);
+            size_t at = 0;
+            for (size_t slot = 0; slot < segment->used; slot++)
+            {
+                Order order;
+                OrderArchive::decode(block, at, order);
+                visit(order);
+            }
+        }
+    }
+
+    // Pages out the full segments older than the newest keepResident ones,
+    // returns the number of orders paged out. A segment paged in but not
+    // touched since reuses its block in the archive instead of storing it again.
+    size_t pageOut(OrderArchive &archive, size_t keepResident)
+    {
+        OrderRegistry &registry = OrderRegistry::instance();
+        size_t pagedOut = 0;
+        for (size_t i = 0; i + keepResident < segments.size(); i++)
+        {
+            Segment &segment = *segments[i];
+            if (segment.paged || segment.used < SEGMENT_SIZE)
+            {
+                continue;
+            }
+            if (segment.dirty || segment.archive != &archive)
+            {
+                string block;
+                for (size_t slot = 0; slot < segment.used; slot++)
+                {
+                    OrderArchive::encode(*segment.orders[slot], block);
+                }
+                segment.offset = archive.store(block);
+                segment.length = block.size();
+                segment.archive = &archive;
+                segment.dirty = false;
+            }
+            for (size_t slot = 0; slot < segment.used; slot++)
+            {
+                uint64_t orderId = segment.orders[slot]->orderId;
+                registry.releaseOrder(orderId);
+                segment.ids[slot] = orderId; // replaces the pointer
+            }
+            segment.paged = true;
+            pagedOut += segment.used;
+        }
+        return pagedOut;
+    }
+
+    // Drops cancelled orders from the resident segments, destroys them in the
+    // registry and rebuilds index. Returns the number of orders removed.
+    size_t compact(unordered_map<uint64_t, size_t> &index)
+    {
+        OrderRegistry &registry = OrderRegistry::instance();
+        vector<unique_ptr<Segment>> kept;
+        for (auto &segment : segments)
+        {
+            if (segment->paged)
+            {
+                kept.push_back(move(segment));
+                continue;
+            }
+            for (size_t slot = 0; slot < segment->used; slot++)
+            {
+                Order *order = segment->orders[slot];
+                if (order->isCancelled)
+                {
+                    registry.releaseOrder(order->orderId);
+                    continue;
+                }
+                if (kept.empty() || kept.back()->paged || kept.back()->used == SEGMENT_SIZE)
+                {
+                    kept.push_back(make_unique<Segment>());
+                }
+                kept.back()->orders[kept.back()->used++] = order;
+            }
+        }
+        segments = move(kept);
+
+        size_t before = count;
+        count = 0;
+        index.clear();
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            const Segment &segment = *segments[i];
+            for (size_t slot = 0; slot < segment.used; slot++)
+            {
+                uint64_t orderId = segment.paged ? segment.ids[slot] : segment.orders[slot]->orderId;
+                index[orderId] = i * SEGMENT_SIZE + slot;
+            }
+            count += segment.used;
+        }
+        return before - count;
+    }
+
+private:
+    struct Segment
+    {
+        size_t used = 0;
+        bool paged = false;
+        bool dirty = true; // archive block missing or out of date
+        union
+        {
+            Order *orders[SEGMENT_SIZE]; // while resident
+            uint64_t ids[SEGMENT_SIZE];  // while paged out
+        };
+        OrderArchive *archive = NULL;
+        uint64_t offset = 0;
+        size_t length = 0;
+    };
+
+    vector<unique_ptr<Segment>> segments;
+    size_t count = 0;
+
+    void pageIn(Segment &segment)
+    {
+        OrderRegistry &registry = OrderRegistry::instance();
+        string block = segment.archive->load(segment.offset, segment.length);
+        size_t at = 0;
+        for (size_t slot = 0; slot < segment.used; slot++)
+        {
+            OrderPtr order = registry.createOrder(segment.ids[slot]);
+            OrderArchive::decode(block, at, *order);
+            segment.orders[slot] = registry.registerOrder(move(order));
+        }
+        segment.paged = false;
+    }
+};
+
+class Customer
+{
+public:
+    string name;
+    int custid;
+    string contactNumber;
+    string address;
+    string emailAddress;
+    OrderHistory orders; // customer has Orders, owned by the OrderRegistry
+
+    // Cancelled orders stay in place as tombstones (Order::isCancelled) until
+    // compactOrders() drops them, orderIndex maps an order id to its location
+    unordered_map<uint64_t, size_t> orderIndex;
+    size_t cancelledCount = 0;
+    mutex ordersLock;
+
+    // Orders submitted for payment whose outcome is not in yet
+    atomic<int> paymentsPending{0};
+
+    // Print order progress to cout, benchmarks turn it off
+    static inline bool verbose = true;
+
+    Customer()
+    {
+        this->custid = 0;
+        this->contactNumber = "";
+        this->address = "";
+        this->emailAddress = "";
+    }
+    Customer(string name, int cid, string contact, string address, string email)
+    {
+        this->name = name;
+        this->custid = cid;
+        this->contactNumber = contact;
+        this->address = address;
+        this->emailAddress = email;
+    }
+
+    void print()
+    {
+        cout << "Customer name: " << name << endl;
+        cout << "Contact number: " << contactNumber << endl;
+        cout << "Address: " << address << endl;
+        cout << "Email address: " << emailAddress << endl;
+    }
+
+    // Method to place an order for the whole cart, blocks until the payment
+    // has gone through. True if it was paid, an error if the cart was rejected.
+    Expected<bool> placeOrder(const ShoppingCart &cart, Inventory &inventory, PaymentGateway *paymentGateway);
+
+    // Reserves stock for the whole cart in one batch and submits the payment
+    // without waiting for it. The future becomes true once the order is paid
+    // and added to the history, or holds the error of a rejected cart.
+    future<Expected<bool>> placeOrderAsync(const ShoppingCart &cart, Inventory &inventory,
+                                           PaymentGateway *paymentGateway);
+
+    // Same, onPaid runs on a payment dispatcher thread with the outcome and
+    // the order. A declined order is destroyed once onPaid returns. A rejected
+    // cart returns its error and onPaid never runs.
+    Expected<void> placeOrderAsync(const ShoppingCart &cart, Inventory &inventory, PaymentGateway *paymentGateway,
+                                   function<void(bool, const Order &)> onPaid);
+
+    Expected<void> cancelOrder(uint64_t orderId, Inventory &inventory)
+    {
+        Expected<void> cancelled = markCancelled(orderId, inventory);
+        if (cancelled && verbose)
+        {
+            cout << "Order with ID " << orderId << " has been cancelled." << endl;
+        }
+        return cancelled;
+    }
+
+    // Marks the order as cancelled and puts its units back on sale
+    Expected<void> markCancelled(uint64_t orderId, Inventory &inventory)
+    {
+        Metrics::Timer timer(Metrics::CANCEL_ORDER_LATENCY);
+        lock_guard<mutex> lock(ordersLock);
+        auto it = orderIndex.find(orderId);
+
+        // An unknown or already cancelled order id is invalid
+        Order *order = it == orderIndex.end() ? NULL : orders.at(it->second);
+        if (order == NULL || order->isCancelled)
+        {
+            Metrics::count(Metrics::CANCELS_REJECTED);
+            return OrderError::INVALID_ORDER_ID;
+        }
+        Metrics::count(Metrics::ORDERS_CANCELLED);
+
+        order->isCancelled = true;
+        orders.changed(it->second);
+        for (const auto &item : order->items)
+        {
+            if (inventory.contains(item.productId))
+            {
+                inventory.increaseStock(item.productId, item.quantity);
+            }
+        }
+        cancelledCount++;
+        return Expected<void>();
+    }
+
+    // Puts a registered, paid order back into the history, for recovery
+    void restoreOrder(Order *order)
+    {
+        lock_guard<mutex> lock(ordersLock);
+        addOrder(order);
+    }
+
+    // Worth compacting once tombstones make up half of the order history
+    bool needsCompaction()
+    {
+        lock_guard<mutex> lock(ordersLock);
+        return cancelledCount >= MIN_COMPACTION && cancelledCount * 2 >= orders.size();
+    }
+
+    // Drops cancelled orders from the history and rebuilds the id index,
+    // returns the number of orders removed
+    size_t compactOrders()
+    {
+        lock_guard<mutex> lock(ordersLock);
+        cancelledCount = 0;
+        return orders.compact(orderIndex);
+    }
+
+    // Moves all but the newest keepResident segments of the history to the
+    // archive, tombstones are dropped first so they are never paged out.
+    // Returns the number of orders paged out.
+    size_t pageOutHistory(OrderArchive &archive, size_t keepResident)
+    {
+        lock_guard<mutex> lock(ordersLock);
+        if (cancelledCount > 0)
+        {
+            orders.compact(orderIndex);
+            cancelledCount = 0;
+        }
+        return orders.pageOut(archive, keepResident);
+    }
+
+    size_t orderCount()
+    {
+        lock_guard<mutex> lock(ordersLock);
+        return orders.size();
+    }
+
+    // True once the order is paid and in the history
+    bool hasOrder(uint64_t orderId)
+    {
+        lock_guard<mutex> lock(ordersLock);
+        return orderIndex.count(orderId) > 0;
+    }
+
+    // Id of the most recently paid order, 0 before the first one
+    uint64_t lastOrderId()
+    {
+        lock_guard<mutex> lock(ordersLock);
+        return latestOrderId;
+    }
+
+    // Visits the order history, paged out orders included
+    void forEachOrder(const function<void(const Order &)> &visit)
+    {
+        lock_guard<mutex> lock(ordersLock);
+        orders.forEach(visit);
+    }
+
+private:
+    static const size_t MIN_COMPACTION = 64;
+
+    uint64_t latestOrderId = 0;
+
+    // Appends a paid order to the history, caller holds ordersLock
+    void addOrder(Order *order)
+    {
+        orderIndex[order->orderId] = orders.append(order);
+        latestOrderId = order->orderId;
+    }
+};
+
+// Every customer, keyed by custid. The directory owns the customers. It is
+// split into shards that each have their own lock, map and Customer pool,
+// so lookups only share-lock one shard and adding customers on different
+// shards never contends.
+class CustomerDirectory
+{
+public:
+    CustomerDirectory() {}
+    CustomerDirectory(const CustomerDirectory &) = delete;
+    CustomerDirectory &operator=(const CustomerDirectory &) = delete;
+
+    ~CustomerDirectory()
+    {
+        for (auto &shard : shards)
+        {
+            for (auto &entry : shard.customers)
+            {
+                shard.pool.destroy(entry.second);
+            }
+        }
+    }
+
+    // Throws DuplicateCustomerException if the custid is taken
+    Customer *addCustomer(const string &name, int custid, const string &contact, const string &address,
+                          const string &email)
+    {
+        Shard &shard = shardFor(custid);
+        unique_lock<shared_mutex> lock(shard.lock);
+        if (shard.customers.count(custid) > 0)
+        {
+            throw DuplicateCustomerException();
+        }
+        Customer *customer = shard.pool.create(name, custid, contact, address, email);
+        shard.customers[custid] = customer;
+        return customer;
+    }
+
+    // Returns NULL if there is no customer with this id
+    Customer *findCustomer(int custid)
+    {
+        Shard &shard = shardFor(custid);
+        shared_lock<shared_mutex> lock(shard.lock);
+        auto it = shard.customers.find(custid);
+        return it == shard.customers.end() ? NULL : it->second;
+    }
+
+    Customer &getCustomer(int custid)
+    {
+        Customer *customer = findCustomer(custid);
+        if (customer == NULL)
+        {
+            throw CustomerNotFoundException();
+        }
+        return *customer;
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+        for (auto &shard : shards)
+        {
+            shared_lock<shared_mutex> lock(shard.lock);
+            total += shard.customers.size();
+        }
+        return total;
+    }
+
+    // Visits every customer, one shard at a time
+    void forEach(const function<void(Customer &)> &visit)
+    {
+        for (size_t shard = 0; shard < shardCount(); shard++)
+        {
+            forEachInShard(shard, visit);
+        }
+    }
+
+    // Shards can be visited from different threads in parallel
+    size_t shardCount() const
+    {
+        return SHARD_COUNT;
+    }
+
+    void forEachInShard(size_t shard, const function<void(Customer &)> &visit)
+    {
+        shared_lock<shared_mutex> lock(shards[shard].lock);
+        for (auto &entry : shards[shard].customers)
+        {
+            visit(*entry.second);
+        }
+    }
+
+private:
+    static const int SHARD_COUNT = 64;
+
+    struct alignas(64) Shard
+    {
+        shared_mutex lock;
+        unordered_map<int, Customer *> customers;
+        ObjectPool<Customer> pool;
+    };
+
+    Shard shards[SHARD_COUNT];
+
+    Shard &shardFor(int custid)
+    {
+        // Customer ids are often assigned in runs, mix them before picking a shard
+        return shards[((uint32_t)custid * 2654435761U) >> 26];
+    }
+};
+
+// Compacts the order history of the directory's customers on a background
+// thread, so cancelOrder only has to set a tombstone. With an archive it
+// also pages out all but the newest residentSegments of each history.
+class OrderCompactor
+{
+public:
+    OrderCompactor(CustomerDirectory &directory, chrono::milliseconds interval = chrono::milliseconds(500),
+                   OrderArchive *archive = NULL, size_t residentSegments = 4)
+        : directory(directory)
+    {
+        this->interval = interval;
+        this->archive = archive;
+        this->residentSegments = residentSegments;
+    }
+
+    ~OrderCompactor()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        lock_guard<mutex> lock(stateLock);
+        if (worker.joinable())
+        {
+            return;
+        }
+        running = true;
+        worker = thread(&OrderCompactor::run, this);
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(stateLock);
+            running = false;
+        }
+        wakeup.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+private:
+    CustomerDirectory &directory;
+    chrono::milliseconds interval;
+    OrderArchive *archive;
+    size_t residentSegments;
+    atomic<bool> running{false}; // written under stateLock, read by the sweep without it
+    mutex stateLock;
+    condition_variable wakeup;
+    thread worker;
+
+    void run()
+    {
+        unique_lock<mutex> lock(stateLock);
+        while (running)
+        {
+            wakeup.wait_for(lock, interval);
+
+            // Sweep without the state lock, stop() only waits for the
+            // customer being compacted
+            lock.unlock();
+            directory.forEach([this](Customer &customer)
+                              {
+                if (!running)
+                {
+                    return;
+                }
+                if (archive != NULL)
+                {
+                    customer.pageOutHistory(*archive, residentSegments);
+                }
+                else if (customer.needsCompaction())
+                {
+                    customer.compactOrders();
+                } });
+            lock.lock();
+        }
+    }
+};
+
+// Renders customer invoices into a ReportBuffer. The scratch arrays are kept
+// between invoices, so a renderer that is reused does not allocate once it
+// has seen the largest history. Use one renderer per thread.
+class InvoiceRenderer
+{
+public:
+    // Returns the total of the customer's non-cancelled orders
+    Money render(Customer &customer, Inventory &inventory, ReportBuffer &out)
+    {
+        out << "=========================================\n";
+        out << "           INVOICE - Total Bill          \n";
+        out << "=========================================\n";
+        out << "Customer Name: " << customer.name << '\n';
+        out << "Customer ID: " << customer.custid << '\n';
+        out << "Contact Number: " << customer.contactNumber << '\n';
+        out << "Address: " << customer.address << '\n';
+        out << "Email Address: " << customer.emailAddress << '\n';
+        out << "-----------------------------------------\n";
+        out << "Order Details:\n";
+
+        // Pack the lines of the non-cancelled orders and price them in one batch
+        billed.clear();
+        lines.clear();
+        unitCents.clear();
+        quantities.clear();
+        orderOffsets.assign(1, 0);
+        customer.forEachOrder([this](const Order &order)
+                              {
+            if (order.isCancelled == false)
+            {
+                for (const auto &item : order.items)
+                {
+                    lines.push_back(item);
+                    unitCents.push_back(item.unitPrice.minorUnits);
+                    quantities.push_back(item.quantity);
+                }
+                billed.push_back(order.orderId);
+                orderOffsets.push_back(unitCents.size());
+            } });
+        lineCents.resize(unitCents.size());
+        orderCents.resize(billed.size());
+        Money total(PricingKernel::invoiceTotals(unitCents.data(), quantities.data(), orderOffsets.data(),
+                                                 billed.size(), lineCents.data(), orderCents.data()));
+
+        for (size_t k = 0; k < billed.size(); k++)
+        {
+            out << "Order ID: " << billed[k] << '\n';
+            out << "Products: \n";
+            for (size_t line = orderOffsets[k]; line < orderOffsets[k + 1]; line++)
+            {
+                const LineItem &item = lines[line];
+                Product *product = inventory.findProduct(item.productId);
+                out << "- ";
+                if (product != NULL)
+                {
+                    out << product->product_name;
+                }
+                else
+                {
+                    out << "Product " << item.productId;
+                }
+                out << " x " << item.quantity << " (Price per item: Rs" << item.unitPrice << ")\n";
+            }
+            out << "Subtotal for this order: Rs. " << Money(orderCents[k]) << "\n\n";
+            out << "-----------------------------------------\n";
+        }
+
+        out << "\nTotal Amount to be Paid: Rs. " << total << '\n';
+        out << "=========================================\n";
+        return total;
+    }
+
+    // Writes the invoice of every customer in the directory to fd and
+    // returns how many were written. The directory's shards are split
+    // between threads, each rendering into its own buffer and writing whole
+    // invoices in batches of about batchBytes, so invoices never interleave
+    // but their order in the output is not fixed.
+    static size_t renderAll(CustomerDirectory &directory, Inventory &inventory, int fd,
+                            size_t threads = max(1u, thread::hardware_concurrency()), size_t batchBytes = 1 << 20)
+    {
+        mutex outputLock;
+        atomic<size_t> rendered{0};
+        atomic<size_t> nextShard{0};
+        atomic<bool> failed{false};
+        auto work = [&]()
+        {
+            InvoiceRenderer renderer;
+            ReportBuffer out;
+            auto writeBatch = [&]()
+            {
+                lock_guard<mutex> lock(outputLock);
+                if (!out.writeTo(fd))
+                {
+                    failed = true;
+                }
+            };
+            for (size_t shard = nextShard++; shard < directory.shardCount(); shard = nextShard++)
+            {
+                directory.forEachInShard(shard, [&](Customer &customer)
+                                         {
+                    renderer.render(customer, inventory, out);
+                    rendered.fetch_add(1, memory_order_relaxed);
+                    if (out.size() >= batchBytes)
+                    {
+                        writeBatch();
+                    } });
+            }
+            writeBatch();
+        };
+
+        vector<thread> workers;
+        for (size_t i = 1; i < max<size_t>(threads, 1); i++)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        if (failed)
+        {
+            throw ReportWriteException();
+        }
+        return rendered.load();
+    }
+
+private:
+    vector<uint64_t> billed;
+    vector<LineItem> lines;
+    vector<int64_t> unitCents;
+    vector<int32_t> quantities;
+    vector<size_t> orderOffsets;
+    vector<int64_t> lineCents;
+    vector<int64_t> orderCents;
+};
+
+Expected<bool> Customer::placeOrder(const ShoppingCart &cart, Inventory &inventory, PaymentGateway *paymentGateway)
+{
+    return placeOrderAsync(cart, inventory, paymentGateway).get();
+}
+
+future<Expected<bool>> Customer::placeOrderAsync(const ShoppingCart &cart, Inventory &inventory,
+                                                 PaymentGateway *paymentGateway)
+{
+    auto result = make_shared<promise<Expected<bool>>>();
+    Expected<void> submitted = placeOrderAsync(cart, inventory, paymentGateway, [result](bool paid, const Order &)
+                                               { result->set_value(paid); });
+    if (!submitted)
+    {
+        result->set_value(submitted.error());
+    }
+    return result->get_future();
+}
+
+Expected<void> Customer::placeOrderAsync(const ShoppingCart &cart, Inventory &inventory,
+                                         PaymentGateway *paymentGateway, function<void(bool, const Order &)> onPaid)
+{
+    // Reserve stock for the whole basket first, a short line leaves no units held
+    auto started = chrono::steady_clock::now();
+    Expected<vector<OrderItem>> reserved = inventory.reserveBasket(cart);
+    if (!reserved)
+    {
+        Metrics::count(Metrics::ORDERS_REJECTED);
+        return reserved.error();
+    }
+    vector<OrderItem> products = move(*reserved);
+
+    // Create a new order, it is handed to the registry once it is paid for
+    OrderRegistry &registry = OrderRegistry::instance();
+    OrderPtr created = registry.createOrder(registry.nextOrderId());
+    created->custid = custid;
+    Order &newOrder = *created;
+
+    // Add all the products present in the vector to the Order of customer
+    for (const auto &item : products)
+    {
+        newOrder.addProduct(item.product, item.quantity);
+    }
+
+
+    // Display order details
+    if (verbose)
+    {
+        cout << "Order Details:" << endl;
+        cout << "Order ID: " << newOrder.orderId << endl;
+        cout << "Customer Name: " << name << endl;
+        cout << "Products: ";
+        for (const auto &item : products)
+        {
+            cout << item.product->product_name << ", ";
+        }
+        cout << endl;
+    }
+
+
+    // Process the payment using the payment gateway. The pricing arrays live
+    // in a per-request arena that is released in one go on return.
+    char scratch[1024];
+    pmr::monotonic_buffer_resource arena(scratch, sizeof(scratch));
+    pmr::vector<int64_t> unitCents(&arena);
+    pmr::vector<int32_t> quantities(&arena);
+    for (const auto &item : newOrder.items)
+    {
+        unitCents.push_back(item.unitPrice.minorUnits);
+        quantities.push_back(item.quantity);
+    }
+    Money totalAmount(PricingKernel::subtotal(unitCents.data(), quantities.data(), unitCents.size()));
+
+
+    // The pending order rides along with the payment, the completion takes
+    // ownership back when the gateway answers and settles the reservations
+    Order *pending = created.release();
+    auto onComplete = [this, &inventory, pending, products, totalAmount, onPaid, started](bool authorized)
+    {
+        Metrics::recordSince(Metrics::PLACE_ORDER_LATENCY, started);
+        Metrics::count(authorized ? Metrics::ORDERS_PLACED : Metrics::ORDERS_DECLINED);
+        OrderPtr order(pending);
+        const Order *outcome = pending;
+        if (authorized)
+        {
+            inventory.commitBasket(products);
+            order->isPaid = true;
+            Order *registered = OrderRegistry::instance().registerOrder(move(order));
+            outcome = registered;
+            {
+                lock_guard<mutex> lock(ordersLock);
+                addOrder(registered); // Add the order to the customer's order history
+            }
+            if (verbose)
+            {
+                cout << "Payment processed successfully!" << endl;
+                cout << "Amount to be paid : " << totalAmount << endl;
+                cout << "Order successfully placed  !" << endl;
+            }
+        }
+        else
+        {
+            inventory.releaseBasket(products);
+            if (verbose)
+            {
+                cout << "Payment failed. Order not placed." << endl;
+            }
+        }
+        paymentsPending.fetch_sub(1, memory_order_release);
+        if (onPaid)
+        {
+            onPaid(authorized, *outcome);
+        }
+    };
+
+    paymentsPending.fetch_add(1, memory_order_relaxed);
+    try
+    {
+        paymentGateway->submitPayment(newOrder.orderId, totalAmount, onComplete);
+    }
+    catch (PaymentProcessingException &ppe)
+    {
+        onComplete(false);
+    }
+    return Expected<void>();
+}
+
+// Append-only journal of the events that change order and stock state:
+// paid orders with their lines, cancellations and restocks. Stock
+// reservations are not recorded, they do not survive a restart anyway.
+//
+// Each record is [length][crc32][type][payload]. Appends only queue the
+// record; a writer thread writes everything queued in one write() and makes
+// it durable with a single fdatasync(), waiting at most commitWindow for
+// more records to join the group. onDurable runs once the record is on disk,
+// so many concurrent orders share one sync. Replay stops at the first torn
+// or corrupt record, which is where a crash interrupted the last write.
+//
+// The journal is a run of numbered segment files, <path>.1, <path>.2, ...
+// and an optional <path>.checkpoint. A checkpoint folds every sealed
+// segment into the net state they describe, so startup only replays the
+// checkpoint and the segments written after it. See JournalCheckpointer.
+class OrderJournal
+{
+public:
+    enum RecordType : uint8_t
+    {
+        ORDER_PLACED = 1, // a paid order and its lines
+        ORDER_CANCELLED = 2,
+        STOCK_ADDED = 3,
+        CHECKPOINT = 4 // first record of a checkpoint, the first segment it does not cover
+    };
+
+    // Appends go to a new segment after the last existing one, so a torn
+    // tail left by a crash is never written after
+    OrderJournal(const string &path, chrono::microseconds commitWindow = chrono::microseconds(2000),
+                 size_t maxGroupBytes = 1 << 20)
+    {
+        this->path = path;
+        this->commitWindow = commitWindow;
+        this->maxGroupBytes = maxGroupBytes;
+        segment = firstSegment(path);
+        while (access(segmentPath(path, segment).c_str(), F_OK) == 0)
+        {
+            segment++;
+        }
+        fd = openSegment(segment);
+        writer = thread(&OrderJournal::writeGroups, this);
+    }
+
+    ~OrderJournal()
+    {
+        close();
+    }
+
+    void logOrderPlaced(const Order &order, function<void()> onDurable)
+    {
+        string payload;
+        put(payload, order.orderId);
+        put(payload, (int32_t)order.custid);
+        put(payload, (uint32_t)order.items.size());
+        for (const auto &item : order.items)
+        {
+            put(payload, (int32_t)item.productId);
+            put(payload, (int32_t)item.quantity);
+            put(payload, item.unitPrice.minorUnits);
+        }
+        append(ORDER_PLACED, payload, move(onDurable));
+    }
+
+    void logOrderCancelled(uint64_t orderId, int custid, function<void()> onDurable)
+    {
+        string payload;
+        put(payload, orderId);
+        put(payload, (int32_t)custid);
+        append(ORDER_CANCELLED, payload, move(onDurable));
+    }
+
+    void logStockAdded(int productId, int units, function<void()> onDurable)
+    {
+        string payload;
+        put(payload, (int32_t)productId);
+        put(payload, (int32_t)units);
+        append(STOCK_ADDED, payload, move(onDurable));
+    }
+
+    // Number of syncs so far, fewer than records when commits were grouped
+    size_t syncCount()
+    {
+        return syncs.load();
+    }
+
+    const string &basePath() const
+    {
+        return path;
+    }
+
+    // Seals the current segment and continues in a new one. Returns the
+    // sealed segment; it and everything before it are immutable from now on.
+    uint64_t rotate()
+    {
+        lock_guard<mutex> lock(fileLock);
+        if (fd < 0)
+        {
+            throw JournalException();
+        }
+        int next = openSegment(segment + 1);
+        ::close(fd);
+        fd = next;
+        return segment++;
+    }
+
+    // Flushes everything queued and closes the file
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        if (writer.joinable())
+        {
+            writer.join();
+        }
+        lock_guard<mutex> lock(fileLock);
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // Applies the checkpoint and then every intact record of the segments
+    // after it, in order, and returns how many records were applied.
+    // Missing customers or products are skipped. A missing journal is an
+    // empty one.
+    static size_t replay(const string &path, Inventory &inventory, function<Customer *(int)> customerFor,
+                         function<Product *(int)> productFor)
+    {
+        unordered_set<uint64_t> earlyCancels;
+        size_t applied = replayRecords(readFile(checkpointPath(path)), inventory, customerFor, productFor,
+                                       earlyCancels);
+        for (uint64_t n = firstSegment(path); access(segmentPath(path, n).c_str(), F_OK) == 0; n++)
+        {
+            applied += replayRecords(readFile(segmentPath(path, n)), inventory, customerFor, productFor,
+                                     earlyCancels);
+        }
+        return applied;
+    }
+
+    // Folds the current checkpoint and the sealed segments up to and
+    // including throughSegment into a new checkpoint, then removes those
+    // segments. Only immutable files are read, so this runs alongside
+    // appends. Cancelled orders drop out together with their placement, and
+    // restocks are merged per product, so the checkpoint grows with the
+    // number of live orders rather than with the length of the history.
+    static void compact(const string &path, uint64_t throughSegment)
+    {
+        map<uint64_t, string> orders; // live orders by id, as ORDER_PLACED records
+        map<uint64_t, string> earlyCancels;
+        map<int, int64_t> restocked;
+        auto fold = [&](string_view type, string_view record)
+        {
+            size_t at = 1;
+            switch (type[0])
+            {
+            case ORDER_PLACED:
+            {
+                uint64_t orderId = get<uint64_t>(record, at);
+                if (earlyCancels.erase(orderId) == 0)
+                {
+                    orders[orderId] = string(record);
+                }
+                break;
+            }
+            case ORDER_CANCELLED:
+            {
+                uint64_t orderId = get<uint64_t>(record, at);
+                if (orders.erase(orderId) == 0)
+                {
+                    earlyCancels[orderId] = string(record);
+                }
+                break;
+            }
+            case STOCK_ADDED:
+            {
+                int productId = get<int32_t>(record, at);
+                restocked[productId] += get<int32_t>(record, at);
+                break;
+            }
+            }
+        };
+
+        uint64_t first = firstSegment(path);
+        forEachRecord(readFile(checkpointPath(path)), fold);
+        for (uint64_t n = first; n <= throughSegment; n++)
+        {
+            forEachRecord(readFile(segmentPath(path, n)), fold);
+        }
+
+        string output;
+        string payload;
+        put(payload, throughSegment + 1);
+        frame(output, CHECKPOINT, payload);
+        for (const auto &entry : restocked)
+        {
+            // Merged amounts beyond the range of one record are split
+            int64_t remaining = entry.second;
+            while (remaining != 0)
+            {
+                int32_t units = (int32_t)max<int64_t>(INT_MIN, min<int64_t>(INT_MAX, remaining));
+                payload.clear();
+                put(payload, (int32_t)entry.first);
+                put(payload, units);
+                frame(output, STOCK_ADDED, payload);
+                remaining -= units;
+            }
+        }
+        for (const auto &entry : orders)
+        {
+            frame(output, ORDER_PLACED, string_view(entry.second).substr(1));
+        }
+        for (const auto &entry : earlyCancels)
+        {
+            frame(output, ORDER_CANCELLED, string_view(entry.second).substr(1));
+        }
+
+        // Write next to the checkpoint and rename into place, then drop the
+        // folded segments. The rename is synced before the first unlink, so
+        // a crash never keeps the unlinks without the new checkpoint; it can
+        // only leave segments the checkpoint already covers, which replay skips.
+        string temporary = checkpointPath(path) + ".tmp";
+        int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || !writeAll(out, output) || fsync(out) != 0)
+        {
+            if (out >= 0)
+            {
+                ::close(out);
+            }
+            throw JournalException();
+        }
+        ::close(out);
+        if (rename(temporary.c_str(), checkpointPath(path).c_str()) != 0 || !syncDirectoryOf(path))
+        {
+            throw JournalException();
+        }
+        for (uint64_t n = first; n <= throughSegment; n++)
+        {
+            unlink(segmentPath(path, n).c_str());
+        }
+    }
+
+    static uint32_t crc32(string_view data)
+    {
+        static const vector<uint32_t> table = []
+        {
+            vector<uint32_t> entries(256);
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+                }
+                entries[i] = c;
+            }
+            return entries;
+        }();
+        uint32_t c = 0xFFFFFFFFU;
+        for (unsigned char byte : data)
+        {
+            c = table[(c ^ byte) & 0xFF] ^ (c >> 8);
+        }
+        return c ^ 0xFFFFFFFFU;
+    }
+
+private:
+    static const size_t HEADER_SIZE = 8; // length and crc32 of the record
+
+    string path;
+    uint64_t segment; // segment appends go to
+    int fd = -1;
+    mutex fileLock; // held while writing to fd, and while rotating it
+    chrono::microseconds commitWindow;
+    size_t maxGroupBytes;
+    string pending; // encoded records waiting for the next group commit
+    vector<function<void()>> waiting;
+    chrono::steady_clock::time_point firstPending;
+    bool stopping = false;
+    mutex queueLock;
+    condition_variable queueReady;
+    thread writer;
+    atomic<size_t> syncs{0};
+
+    static string segmentPath(const string &path, uint64_t n)
+    {
+        return path + "." + to_string(n);
+    }
+
+    static string checkpointPath(const string &path)
+    {
+        return path + ".checkpoint";
+    }
+
+    static string readFile(const string &path)
+    {
+        ifstream file(path, ios::binary);
+        return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    }
+
+    static bool writeAll(int out, string_view data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = write(out, data.data() + written, data.size() - written);
+            if (n < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            written += n > 0 ? n : 0;
+        }
+        return true;
+    }
+
+    // The first segment not folded into the checkpoint
+    static uint64_t firstSegment(const string &path)
+    {
+        uint64_t first = 1;
+        forEachRecord(readFile(checkpointPath(path)), [&first](string_view type, string_view record)
+                      {
+            size_t at = 1;
+            if (type[0] == CHECKPOINT)
+            {
+                first = get<uint64_t>(record, at);
+            } });
+        return first;
+    }
+
+    int openSegment(uint64_t n)
+    {
+        int opened = open(segmentPath(path, n).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (opened < 0)
+        {
+            throw JournalException();
+        }
+        return opened;
+    }
+
+    template <typename T>
+    static void put(string &out, T value)
+    {
+        out.append((const char *)&value, sizeof(value));
+    }
+
+    template <typename T>
+    static T get(string_view record, size_t &at)
+    {
+        T value = T();
+        if (at + sizeof(T) <= record.size())
+        {
+            memcpy(&value, record.data() + at, sizeof(T));
+        }
+        at += sizeof(T);
+        return value;
+    }
+
+    static void frame(string &out, RecordType type, string_view payload)
+    {
+        string record(1, (char)type);
+        record += payload;
+        put(out, (uint32_t)record.size());
+        put(out, crc32(record));
+        out += record;
+    }
+
+    // Calls visit with the type and the whole record, type byte included,
+    // for every intact record, and stops at the first torn or corrupt one
+    static void forEachRecord(string_view data, const function<void(string_view, string_view)> &visit)
+    {
+        size_t pos = 0;
+        while (pos + HEADER_SIZE <= data.size())
+        {
+            uint32_t length;
+            uint32_t checksum;
+            memcpy(&length, data.data() + pos, sizeof(length));
+            memcpy(&checksum, data.data() + pos + 4, sizeof(checksum));
+            if (length == 0 || pos + HEADER_SIZE + length > data.size())
+            {
+                break; // torn tail
+            }
+            string_view record = data.substr(pos + HEADER_SIZE, length);
+            if (crc32(record) != checksum)
+            {
+                break;
+            }
+            pos += HEADER_SIZE + length;
+            visit(record.substr(0, 1), record);
+        }
+    }
+
+    // A cancel can reach the journal just ahead of the placement of its
+    // order, those are held in earlyCancels until the placement shows up
+    static size_t replayRecords(string_view data, Inventory &inventory, function<Customer *(int)> customerFor,
+                                function<Product *(int)> productFor, unordered_set<uint64_t> &earlyCancels)
+    {
+        OrderRegistry &registry = OrderRegistry::instance();
+        size_t applied = 0;
+        forEachRecord(data, [&](string_view type, string_view record)
+                      {
+            size_t at = 1;
+            switch (type[0])
+            {
+            case ORDER_PLACED:
+            {
+                uint64_t orderId = get<uint64_t>(record, at);
+                int custid = get<int32_t>(record, at);
+                uint32_t lines = get<uint32_t>(record, at);
+                registry.reserveIdsThrough(orderId);
+                if (earlyCancels.erase(orderId) > 0)
+                {
+                    break;
+                }
+                OrderPtr order = registry.createOrder(orderId);
+                order->custid = custid;
+                order->isPaid = true;
+                for (uint32_t i = 0; i < lines && at < record.size(); i++)
+                {
+                    LineItem item;
+                    item.productId = get<int32_t>(record, at);
+                    item.quantity = get<int32_t>(record, at);
+                    item.unitPrice = Money(get<int64_t>(record, at));
+                    order->items.push_back(item);
+                    if (productFor(item.productId) != NULL)
+                    {
+                        inventory.decreaseStock(item.productId, item.quantity);
+                    }
+                }
+                Customer *customer = customerFor(custid);
+                if (customer != NULL)
+                {
+                    customer->restoreOrder(registry.registerOrder(move(order)));
+                }
+                break;
+            }
+            case ORDER_CANCELLED:
+            {
+                uint64_t orderId = get<uint64_t>(record, at);
+                Customer *customer = customerFor(get<int32_t>(record, at));
+                if (registry.findOrder(orderId) == NULL)
+                {
+                    earlyCancels.insert(orderId);
+                }
+                else if (customer != NULL)
+                {
+                    customer->markCancelled(orderId, inventory); // a repeated cancel is a no-op
+                }
+                break;
+            }
+            case STOCK_ADDED:
+            {
+                int productId = get<int32_t>(record, at);
+                int units = get<int32_t>(record, at);
+                if (productFor(productId) != NULL)
+                {
+                    inventory.increaseStock(productId, units);
+                }
+                break;
+            }
+            }
+            applied++; });
+        return applied;
+    }
+
+    void append(RecordType type, const string &payload, function<void()> onDurable)
+    {
+        string record;
+        frame(record, type, payload);
+        bool notify;
+        {
+            lock_guard<mutex> lock(queueLock);
+            if (stopping)
+            {
+                throw JournalException();
+            }
+            if (pending.empty())
+            {
+                firstPending = chrono::steady_clock::now();
+            }
+            pending += record;
+            if (onDurable)
+            {
+                waiting.push_back(move(onDurable));
+            }
+            notify = pending.size() == record.size() || pending.size() >= maxGroupBytes;
+        }
+        if (notify)
+        {
+            queueReady.notify_one();
+        }
+    }
+
+    void writeGroups()
+    {
+        string group;
+        vector<function<void()>> durable;
+        unique_lock<mutex> lock(queueLock);
+        while (true)
+        {
+            queueReady.wait(lock, [this]
+                            { return stopping || !pending.empty(); });
+            if (pending.empty())
+            {
+                return;
+            }
+
+            // Let more records join the group until the window closes
+            queueReady.wait_until(lock, firstPending + commitWindow, [this]
+                                  { return stopping || pending.size() >= maxGroupBytes; });
+            group.swap(pending);
+            durable.swap(waiting);
+            lock.unlock();
+
+            {
+                lock_guard<mutex> file(fileLock);
+                writeAll(fd, group);
+                fdatasync(fd);
+            }
+            syncs.fetch_add(1);
+            for (auto &callback : durable)
+            {
+                callback();
+            }
+            group.clear();
+            durable.clear();
+            lock.lock();
+        }
+    }
+};
+
+// Periodically seals the journal's current segment and folds the sealed
+// segments into a new checkpoint on a background thread. Order intake keeps
+// appending to the fresh segment meanwhile, nothing is paused.
+class JournalCheckpointer
+{
+public:
+    JournalCheckpointer(OrderJournal &journal, chrono::milliseconds interval = chrono::milliseconds(60000))
+        : journal(journal)
+    {
+        this->interval = interval;
+    }
+
+    ~JournalCheckpointer()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        lock_guard<mutex> lock(stateLock);
+        if (worker.joinable())
+        {
+            return;
+        }
+        running = true;
+        worker = thread(&JournalCheckpointer::run, this);
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(stateLock);
+            running = false;
+        }
+        wakeup.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
 
-        int productId;
-        string productName;
-        double price;
-        string brand;
-        int ram;
-        int storage;
+    void checkpointNow()
+    {
+        lock_guard<mutex> lock(checkpointLock);
+        OrderJournal::compact(journal.basePath(), journal.rotate());
+    }
+
+private:
+    OrderJournal &journal;
+    chrono::milliseconds interval;
+    bool running = false;
+    mutex stateLock;
+    mutex checkpointLock; // one checkpoint at a time
+    condition_variable wakeup;
+    thread worker;
+
+    void run()
+    {
+        unique_lock<mutex> lock(stateLock);
+        while (running)
+        {
+            wakeup.wait_for(lock, interval);
+            if (!running)
+            {
+                break;
+            }
+            lock.unlock();
+            try
+            {
+                checkpointNow();
+            }
+            catch (JournalException &je)
+            {
+                cout << je.what() << endl; // the segments stay, the next round retries
+            }
+            lock.lock();
+        }
+    }
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's
+// design). Every cell carries a sequence number that tells producers and
+// consumers whether it is free or full for their lap around the ring, so
+// each operation is a single CAS on the head or tail position.
+template <typename T>
+class MpmcQueue
+{
+public:
+    MpmcQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++)
+        {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the queue is full
+    bool push(T &&value)
+    {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lag = (intptr_t)sequence - (intptr_t)position;
+            if (lag == 0)
+            {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                {
+                    cell.value = move(value);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lag < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T &value)
+    {
+        size_t position = head.load(memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lag = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (lag == 0)
+            {
+                if (head.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                {
+                    value = move(cell.value);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lag < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Approximate, the queue may change while it is read
+    size_t size() const
+    {
+        size_t pushed = tail.load(memory_order_relaxed);
+        size_t popped = head.load(memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};
+    alignas(64) atomic<size_t> head{0};
+};
+
+// A place or cancel request for the OrderEngine. done gets the outcome, or
+// the exception that rejected the request.
+struct OrderRequest
+{
+    enum Kind
+    {
+        PLACE_ORDER,
+        CANCEL_ORDER
+    };
+
+    Kind kind = PLACE_ORDER;
+    Customer *customer = NULL;
+    ShoppingCart cart;    // PLACE_ORDER
+    uint64_t orderId = 0; // CANCEL_ORDER
+    shared_ptr<promise<Expected<bool>>> done;
+};
+
+// Queue depths and counts per stage of the OrderEngine
+struct OrderEngineStats
+{
+    size_t queued;          // waiting in a lane
+    size_t processing;      // taken by a worker
+    size_t awaitingPayment; // stock reserved, payment in flight
+    size_t completed;
+    size_t rejected; // out of stock, unknown order, failed payment
+};
+
+// Runs place and cancel requests on a pool of worker threads.
+//
+// Requests are routed to a lane by customer id. Each lane is a lock-free
+// MPMC queue and is drained by one worker at a time, so the requests of one
+// customer are processed in the order they were submitted. A placement is
+// done processing once its payment is submitted; the lane does not wait for
+// the payment, except that a cancel of an order not in the history yet waits
+// for the customer's payments in flight, so it finds the orders placed
+// before it. Every worker
+// owns a set of lanes and steals whole lanes from other workers when its own
+// are empty, which keeps all cores busy when a few customers are hot.
+class OrderEngine
+{
+public:
+    OrderEngine(Inventory &inventory, PaymentGateway &paymentGateway,
+                size_t workers = max(1u, thread::hardware_concurrency()), size_t laneCapacity = 4096)
+        : inventory(inventory), paymentGateway(paymentGateway)
+    {
+        workerCount = max<size_t>(workers, 1);
+        for (size_t i = 0; i < workerCount * LANES_PER_WORKER; i++)
+        {
+            lanes.push_back(make_unique<Lane>(laneCapacity));
+        }
+        for (size_t i = 0; i < workerCount; i++)
+        {
+            threads.emplace_back(&OrderEngine::work, this, i);
+        }
+    }
+
+    ~OrderEngine()
+    {
+        stop();
+    }
+
+    // With a journal, a request completes only once its journal record is
+    // durable. Set before submitting requests.
+    void setJournal(OrderJournal *journal)
+    {
+        this->journal = journal;
+    }
+
+    // Adds units to a product's stock
+    future<bool> restock(int productId, int units)
+    {
+        auto done = make_shared<promise<bool>>();
+        try
+        {
+            inventory.increaseStock(productId, units);
+            if (journal != NULL)
+            {
+                journal->logStockAdded(productId, units, [done]
+                                       { done->set_value(true); });
+            }
+            else
+            {
+                done->set_value(true);
+            }
+        }
+        catch (...)
+        {
+            done->set_exception(current_exception());
+        }
+        return done->get_future();
+    }
+
+    // The future holds whether the order was paid, or why it was rejected
+    future<Expected<bool>> placeOrder(Customer &customer, const ShoppingCart &cart)
+    {
+        OrderRequest request;
+        request.kind = OrderRequest::PLACE_ORDER;
+        request.customer = &customer;
+        request.cart = cart;
+        return submit(move(request));
+    }
+
+    future<Expected<bool>> cancelOrder(Customer &customer, uint64_t orderId)
+    {
+        OrderRequest request;
+        request.kind = OrderRequest::CANCEL_ORDER;
+        request.customer = &customer;
+        request.orderId = orderId;
+        return submit(move(request));
+    }
+
+    // Waits while the customer's lane is full
+    future<Expected<bool>> submit(OrderRequest &&request)
+    {
+        request.done = make_shared<promise<Expected<bool>>>();
+        future<Expected<bool>> outcome = request.done->get_future();
+        Lane &lane = *lanes[(size_t)request.customer->custid % lanes.size()];
+        while (!lane.requests.push(move(request)))
+        {
+            this_thread::yield();
+        }
+        queued.fetch_add(1, memory_order_relaxed);
+        if (sleeping.load(memory_order_relaxed) > 0)
+        {
+            idleWakeup.notify_one();
+        }
+        return outcome;
+    }
+
+    OrderEngineStats stats() const
+    {
+        OrderEngineStats snapshot;
+        snapshot.queued = queued.load(memory_order_relaxed);
+        snapshot.processing = processing.load(memory_order_relaxed);
+        snapshot.awaitingPayment = awaitingPayment.load(memory_order_relaxed);
+        snapshot.completed = completed.load(memory_order_relaxed);
+        snapshot.rejected = rejected.load(memory_order_relaxed);
+        return snapshot;
+    }
+
+    // Processes everything already submitted, waits for the payments still
+    // in flight, then stops the workers
+    void stop()
+    {
+        stopping = true;
+        idleWakeup.notify_all();
+        for (auto &worker : threads)
+        {
+            if (worker.joinable())
+            {
+                worker.join();
+            }
+        }
+        while (awaitingPayment.load() > 0)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+
+private:
+    static const size_t LANES_PER_WORKER = 4;
+    static const size_t LANE_BATCH = 32; // requests taken per visit to a lane
+
+    struct Lane
+    {
+        MpmcQueue<OrderRequest> requests;
+        atomic<bool> busy{false}; // set while a worker drains the lane
+
+        Lane(size_t capacity) : requests(capacity) {}
+    };
+
+    Inventory &inventory;
+    PaymentGateway &paymentGateway;
+    OrderJournal *journal = NULL;
+    size_t workerCount;
+    vector<unique_ptr<Lane>> lanes; // worker w owns lanes w, w + workerCount, ...
+    vector<thread> threads;
+    atomic<bool> stopping{false};
+
+    alignas(64) atomic<size_t> queued{0};
+    alignas(64) atomic<size_t> processing{0};
+    alignas(64) atomic<size_t> awaitingPayment{0};
+    alignas(64) atomic<size_t> completed{0};
+    alignas(64) atomic<size_t> rejected{0};
+
+    mutex idleLock;
+    condition_variable idleWakeup;
+    atomic<int> sleeping{0};
+
+    void work(size_t worker)
+    {
+        while (true)
+        {
+            // Own lanes first, then steal lanes from the other workers
+            bool didWork = false;
+            for (size_t i = 0; i < LANES_PER_WORKER; i++)
+            {
+                didWork |= drain(*lanes[worker + i * workerCount]);
+            }
+            for (size_t i = 1; i < lanes.size() && !didWork; i++)
+            {
+                size_t lane = (worker + i) % lanes.size();
+                if (lane % workerCount != worker)
+                {
+                    didWork = drain(*lanes[lane]);
+                }
+            }
+            if (didWork)
+            {
+                continue;
+            }
+            if (stopping && queued.load() == 0)
+            {
+                return;
+            }
+            unique_lock<mutex> lock(idleLock);
+            sleeping.fetch_add(1);
+            idleWakeup.wait_for(lock, chrono::milliseconds(1), [this]
+                                { return stopping || queued.load(memory_order_relaxed) > 0; });
+            sleeping.fetch_sub(1);
+        }
+    }
+
+    // Takes the lane if no other worker has it and processes up to a batch
+    bool drain(Lane &lane)
+    {
+        if (lane.requests.size() == 0 || lane.busy.exchange(true, memory_order_acquire))
+        {
+            return false;
+        }
+        size_t taken = 0;
+        OrderRequest request;
+        while (taken < LANE_BATCH && lane.requests.pop(request))
+        {
+            queued.fetch_sub(1, memory_order_relaxed);
+            processing.fetch_add(1, memory_order_relaxed);
+            process(request);
+            processing.fetch_sub(1, memory_order_relaxed);
+            taken++;
+        }
+        lane.busy.store(false, memory_order_release);
+        return taken > 0;
+    }
+
+    void process(OrderRequest &request)
+    {
+        shared_ptr<promise<Expected<bool>>> done = request.done;
+        try
+        {
+            if (request.kind == OrderRequest::CANCEL_ORDER)
+            {
+                // The order may have been placed just before and still be paying
+                while (!request.customer->hasOrder(request.orderId) &&
+                       request.customer->paymentsPending.load(memory_order_acquire) > 0)
+                {
+                    this_thread::yield();
+                }
+                Expected<void> cancelled = request.customer->cancelOrder(request.orderId, inventory);
+                if (!cancelled)
+                {
+                    rejected.fetch_add(1, memory_order_relaxed);
+                    done->set_value(cancelled.error());
+                    return;
+                }
+                completed.fetch_add(1, memory_order_relaxed);
+                if (journal != NULL)
+                {
+                    journal->logOrderCancelled(request.orderId, request.customer->custid, [done]
+                                               { done->set_value(true); });
+                }
+                else
+                {
+                    done->set_value(true);
+                }
+                return;
+            }
+
+            auto onPaid = [this, done](bool paid, const Order &order)
+            {
+                (paid ? completed : rejected).fetch_add(1, memory_order_relaxed);
+                if (paid && journal != NULL)
+                {
+                    journal->logOrderPlaced(order, [this, done]
+                                            {
+                        done->set_value(true);
+                        awaitingPayment.fetch_sub(1, memory_order_relaxed); });
+                    return;
+                }
+                done->set_value(paid);
+                awaitingPayment.fetch_sub(1, memory_order_relaxed);
+            };
+            awaitingPayment.fetch_add(1, memory_order_relaxed);
+            Expected<void> submitted;
+            try
+            {
+                submitted = request.customer->placeOrderAsync(request.cart, inventory, &paymentGateway, onPaid);
+            }
+            catch (...)
+            {
+                awaitingPayment.fetch_sub(1, memory_order_relaxed);
+                throw;
+            }
+            if (!submitted)
+            {
+                awaitingPayment.fetch_sub(1, memory_order_relaxed);
+                rejected.fetch_add(1, memory_order_relaxed);
+                done->set_value(submitted.error());
+            }
+        }
+        catch (...)
+        {
+            rejected.fetch_add(1, memory_order_relaxed);
+            done->set_exception(current_exception());
+        }
+    }
+};
+
+// Benchmarks, run with --bench instead of the interactive session.
+//
+// Micro benchmarks time one operation in a loop in the manner of Google
+// Benchmark: the iteration count doubles until a run takes at least
+// MIN_TIME, and that run is reported as ns/op. The load generator then
+// drives an OrderEngine with a mix of place and cancel requests over SKUs
+// of Zipfian popularity, payments going through a simulated gateway that
+// declines a share of them, and reports latency percentiles and
+// throughput. Everything is printed as one JSON document.
+struct LoadProfile
+{
+    size_t customers = 1000;
+    size_t skus = 10000;
+    double zipfExponent = 1.0; // 0 is uniform, larger is more skewed
+    double cancelRatio = 0.1;  // share of requests that cancel the customer's latest order
+    double paymentFailureRate = 0.01;
+    chrono::microseconds paymentLatency = chrono::microseconds(200); // gateway round trip
+    size_t clients = 4;
+    size_t inFlight = 64; // outstanding requests per client
+    chrono::milliseconds duration = chrono::milliseconds(2000);
+    unsigned int seed = 42;
+};
+
+// Latency samples in nanoseconds
+class LatencySamples
+{
+public:
+    void add(int64_t nanoseconds)
+    {
+        samples.push_back(nanoseconds);
+    }
+
+    void merge(const LatencySamples &other)
+    {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+    }
+
+    size_t count() const
+    {
+        return samples.size();
+    }
+
+    // q in [0, 1], 0 without samples
+    int64_t quantile(double q)
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        size_t rank = min(samples.size() - 1, (size_t)(q * samples.size()));
+        nth_element(samples.begin(), samples.begin() + rank, samples.end());
+        return samples[rank];
+    }
+
+private:
+    vector<int64_t> samples;
+};
+
+// Draws SKU ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s
+class ZipfSampler
+{
+public:
+    ZipfSampler(size_t n, double exponent)
+    {
+        cumulative.resize(n);
+        double total = 0;
+        for (size_t rank = 0; rank < n; rank++)
+        {
+            total += 1.0 / pow((double)(rank + 1), exponent);
+            cumulative[rank] = total;
+        }
+        for (double &weight : cumulative)
+        {
+            weight /= total;
+        }
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng &rng) const
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t rank = lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+        return min(rank, cumulative.size() - 1);
+    }
+
+private:
+    vector<double> cumulative;
+};
+
+class BenchmarkRunner
+{
+public:
+    BenchmarkRunner(const LoadProfile &profile)
+    {
+        this->profile = profile;
+    }
+
+    // Runs every benchmark and writes the JSON report to out
+    void run(ReportBuffer &out)
+    {
+        bool verbose = Customer::verbose;
+        Customer::verbose = false;
+        out << "{\n  \"benchmarks\": [\n";
+        microBenchmarks(out);
+        out << "\n  ],\n";
+        loadTest(out);
+        out << "}\n";
+        Customer::verbose = verbose;
+    }
+
+private:
+    static constexpr chrono::milliseconds MIN_TIME = chrono::milliseconds(200);
+
+    LoadProfile profile;
+    bool firstResult = true;
+
+    // Times body(iterations), doubling iterations until the run is long
+    // enough or reaches maxIterations. setup(iterations) runs untimed
+    // before each run.
+    void measure(ReportBuffer &out, const char *name, const function<void(size_t)> &body,
+                 const function<void(size_t)> &setup = NULL, size_t maxIterations = (size_t)1 << 30)
+    {
+        size_t iterations = 1;
+        chrono::nanoseconds elapsed(0);
+        while (true)
+        {
+            if (setup)
+            {
+                setup(iterations);
+            }
+            auto start = chrono::steady_clock::now();
+            body(iterations);
+            elapsed = chrono::steady_clock::now() - start;
+            if (elapsed >= MIN_TIME || iterations >= maxIterations)
+            {
+                break;
+            }
+            iterations *= 2;
+        }
+        out << (firstResult ? "" : ",\n");
+        out << "    {\"name\": \"" << name << "\", \"iterations\": " << iterations << ", \"ns_per_op\": "
+            << (int64_t)(elapsed.count() / iterations) << "}";
+        firstResult = false;
+    }
+
+    static void fillInventory(Inventory &inventory, size_t skus)
+    {
+        inventory.reserve(skus);
+        for (size_t i = 0; i < skus; i++)
+        {
+            Product *product = inventory.addProduct(makeProduct<Shirt>((int)i + 1, "Shirt " + to_string(i + 1),
+                                                                       Money(49900 + (int64_t)i % 1000), "M",
+                                                                       "Blue", "Cotton"));
+            product->increaseStock(INT_MAX / 2 - product->stockLevel());
+        }
+    }
+
+    // Every product type in random order, as a real catalogue file would have them
+    static void fillMixedInventory(Inventory &inventory, size_t products)
+    {
+        static const char *brands[] = {"Dell", "Lenovo", "Apple", "Samsung"};
+        static const char *colors[] = {"Red", "Blue", "Black", "White"};
+        mt19937 rng(7);
+        inventory.reserve(products);
+        for (size_t i = 0; i < products; i++)
+        {
+            ProductType type = (ProductType)(rng() % ProductTypeRegistry::size);
+            string numbers[2] = {to_string(4 << (rng() % 4)), to_string(64 << (rng() % 4))};
+            string_view raw[3] = {brands[rng() % 4], colors[rng() % 4], "Standard"};
+            for (int a = 0; a < 3; a++)
+            {
+                if (ProductTypeRegistry::attributes[type][a].numeric)
+                {
+                    raw[a] = numbers[a % 2];
+                }
+            }
+            AttributeValues values;
+            ProductTypeRegistry::parseAttributes(type, raw, values);
+            inventory.addProduct(ProductTypeRegistry::create(type, (int)i + 1, "Product " + to_string(i + 1),
+                                                             Money(1000 + (int64_t)(rng() % 100000)), values));
+        }
+    }
 
-        cout << "Enter product ID: ";
-        cin >> productId;
-        cout << "Enter product name: ";
-        cin >> productName;
-        cout << "Enter price: ";
-        cin >> price;
-        cout << "Enter brand: ";
-        cin >> brand;
-        cout << "Enter RAM : ";
-        cin >> ram;
+    void microBenchmarks(ReportBuffer &out)
+    {
+        CatalogueRecord record;
+        record.type = "L";
+        record.productId = "7";
+        record.name = "Notebook";
+        record.price = "54999.00";
+        record.stock = "10";
+        record.attributes[0] = "Dell";
+        record.attributes[1] = "i7";
+        record.attributes[2] = "16";
+        measure(out, "ProductFactory::createProduct", [&record](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                ProductPtr product = ProductFactory::createProduct(record);
+            } });
 
+        Inventory inventory;
+        fillInventory(inventory, 1024);
+        PaymentGateway gateway(64, chrono::microseconds(0));
+        Customer customer("Bench", 1, "", "", "");
+        ShoppingCart cart;
+        cart.add(1, 1);
+        cart.add(2, 2);
+        cart.add(3, 1);
+        measure(out, "Customer::placeOrder", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                customer.placeOrder(cart, inventory, &gateway);
+            } });
 
-        try
+        // Each run cancels orders placed for it beforehand
+        vector<uint64_t> placed;
+        auto placeForCancel = [&](size_t iterations)
         {
-            if (productType == 'L' || productType == 'l')
+            vector<future<Expected<bool>>> paid;
+            for (size_t i = 0; i < iterations; i++)
             {
-                return make_unique<Laptop>(productId, productName, price, brand, "Intel", ram);
+                paid.push_back(customer.placeOrderAsync(cart, inventory, &gateway));
             }
-            else if (productType == 'M' || productType == 'm')
+            for (auto &done : paid)
             {
-                cout << "Enter storage (for mobiles): ";
-                cin >> storage;
-                return make_unique<Mobile>(productId, productName, price, brand, storage, ram);
+                done.wait();
             }
-            else
+            placed.clear();
+            customer.forEachOrder([&placed](const Order &order)
+                                  {
+                if (!order.isCancelled)
+                {
+                    placed.push_back(order.orderId);
+                } });
+        };
+        measure(
+            out, "Customer::cancelOrder", [&](size_t iterations)
             {
-                throw InvalidElectronicsException();
-            }
+            for (size_t i = 0; i < iterations; i++)
+            {
+                customer.cancelOrder(placed[placed.size() - 1 - i], inventory);
+            } },
+            placeForCancel, (size_t)1 << 16);
+
+        // A rejected request should cost no more than an accepted one
+        ShoppingCart shortCart;
+        shortCart.add(1, INT_MAX);
+        measure(out, "Customer::placeOrder/rejected", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                customer.placeOrder(shortCart, inventory, &gateway);
+            } });
+
+        // Invoice totals over 1000 orders of 4 lines
+        const size_t orders = 1000;
+        const size_t lines = 4;
+        vector<int64_t> unitCents(orders * lines);
+        vector<int32_t> quantities(orders * lines);
+        vector<size_t> offsets(orders + 1);
+        for (size_t i = 0; i < unitCents.size(); i++)
+        {
+            unitCents[i] = 1000 + (int64_t)i % 97 * 100;
+            quantities[i] = 1 + (int32_t)(i % 5);
         }
-        catch (InvalidElectronicsException &iee)
+        for (size_t k = 0; k <= orders; k++)
         {
-            cout << iee.what();
+            offsets[k] = k * lines;
         }
-        return NULL;
-
-    }
-
-    static unique_ptr<Furniture> createFurnitureProduct()
-    {
-        char productType;
-        cout << "Enter the type of furniture (C for Chair, T for Table): ";
-        cin >> productType;
+        vector<int64_t> lineCents(unitCents.size());
+        vector<int64_t> orderCents(orders);
+        int64_t sink = 0;
+        measure(out, "PricingKernel::invoiceTotals/1000x4", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                sink += PricingKernel::invoiceTotals(unitCents.data(), quantities.data(), offsets.data(), orders,
+                                                     lineCents.data(), orderCents.data());
+            } });
 
-        int productId;
-        string productName;
-        double price;
+        // Invoice of a customer with 16 orders
+        Customer billed("Invoice", 2, "", "", "");
+        for (int i = 0; i < 16; i++)
+        {
+            billed.placeOrder(cart, inventory, &gateway);
+        }
+        InvoiceRenderer renderer;
+        ReportBuffer invoice;
+        measure(out, "InvoiceRenderer::render/16", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                sink += renderer.render(billed, inventory, invoice).minorUnits;
+                invoice.clear();
+            } });
 
-        string material;
-        int capacity;
-        string chairColor;
-        string chairType;
+        // Product details of a mixed catalogue, through the virtual call per
+        // product and through a type grouped sheet of values
+        Inventory mixed;
+        fillMixedInventory(mixed, 4096);
+        ProductSheet sheet = ProductSheet::fromInventory(mixed);
+        ReportBuffer details;
+        measure(out, "Product::writeDetails/4096", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                for (size_t slot = 0; slot < mixed.size(); slot++)
+                {
+                    mixed.productAt(slot)->writeDetails(details);
+                    details << '\n';
+                }
+                sink += details.size();
+                details.clear();
+            } });
+        measure(out, "ProductSheet::writeDetails/4096", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                sheet.writeDetails(details);
+                sink += details.size();
+                details.clear();
+            } });
 
-        cout << "Enter product ID: ";
-        cin >> productId;
-        cout << "Enter product name: ";
-        cin >> productName;
-        cout << "Enter price: ";
-        cin >> price;
-        cout << "Enter material: ";
-        cin >> material;
+        // Faceted queries over the same catalogue, a selective facet pair and
+        // a facet with a price range
+        ProductQuery laptops;
+        laptops.category = CATEGORY_ELECTRONICS;
+        laptops.ram = 16;
+        ProductQuery cheapRed;
+        cheapRed.color = "Red";
+        cheapRed.maxPrice = Money(20000);
+        measure(out, "Inventory::query/4096", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                sink += mixed.query(laptops).size();
+                sink += mixed.query(cheapRed).size();
+            } });
 
-        try
+        // Type-ahead over 4096 names. The short typo queries are scanned,
+        // the longer ones go through the trigram postings.
+        static const char *nouns[] = {"Shirt", "Table", "Jeans", "Laptop", "Sofa", "Mobile", "Shorts", "Tablet"};
+        static const char *styles[] = {"Classic", "Slim", "Oak", "Pro", "Air", "Denim", "Linen", "Max"};
+        Inventory named;
+        named.reserve(4096);
+        for (int i = 0; i < 4096; i++)
         {
-            if (productType == 'C' || productType == 'c')
+            string name = string(nouns[i % 8]) + " " + styles[i / 8 % 8] + " " + to_string(i + 1);
+            named.addProduct(makeProduct<Shirt>(i + 1, name, Money(49900), "M", "Blue", "Cotton"));
+        }
+        measure(out, "Inventory::searchByPrefix/4096", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
             {
-                cout << "Enter the chair type: ";
-                cin >> chairType;
-                cout << "Enter the color of chair : ";
-                cin >> chairColor;
-                return make_unique<Chair>(productId, productName, price, material, chairColor, chairType);
-            }
-            else if (productType == 'T' || productType == 't')
+                sink += named.searchByPrefix("sh", 10).size();
+                sink += named.searchByPrefix("laptop pro", 10).size();
+            } });
+        measure(out, "Inventory::searchByName/short", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
             {
-                cout << "Enter capacity (for tables): ";
-                cin >> capacity;
-                return make_unique<Table>(productId, productName, price, material, capacity);
-            }
-            else
+                sink += named.searchByName("shrt", 10).size();
+                sink += named.searchByName("tabel", 10).size();
+                sink += named.searchByName("jaens", 10).size();
+                sink += named.searchByName("laptpo", 10, 2).size();
+            } });
+        measure(out, "Inventory::searchByName/long", [&](size_t iterations)
+                {
+            for (size_t i = 0; i < iterations; i++)
             {
-                throw InvalidFurnitureException();
-            }
-        }
-        catch (InvalidFurnitureException &ife)
+                sink += named.searchByName("laptop clasic", 10).size();
+                sink += named.searchByName("mobile dnim 4", 10).size();
+            } });
+        gateway.stop();
+        if (sink == 42)
         {
-            cout << ife.what() << endl;
+            out << ""; // keeps the totals observable
         }
-        return NULL;
     }
 
-
-    static unique_ptr<Clothing> createClothingProduct()
+    void loadTest(ReportBuffer &out)
     {
-        char productType;
-        cout << "Enter the type of clothing (S for Shirt, J for Jeans): ";
-        cin >> productType;
-
-        int productId;
-        string productName;
-        double price;
+        Inventory inventory;
+        fillInventory(inventory, profile.skus);
+        CustomerDirectory customers;
+        for (size_t i = 0; i < profile.customers; i++)
+        {
+            customers.addCustomer("Customer " + to_string(i), (int)i, "", "", "");
+        }
+        PaymentGateway gateway(64, chrono::microseconds(200), 4,
+                               make_unique<SimulatedPaymentBackend>(profile.paymentLatency,
+                                                                    profile.paymentFailureRate, profile.seed));
+        OrderEngine engine(inventory, gateway);
+        ZipfSampler skuRank(profile.skus, profile.zipfExponent);
 
-        string size;
-        string color;
-        string denim_style;
-        string fabric;
+        struct Pending
+        {
+            bool cancel;
+            chrono::steady_clock::time_point start;
+            future<Expected<bool>> done;
+        };
+        struct ClientResult
+        {
+            LatencySamples place;
+            LatencySamples cancel;
+            size_t failed = 0;
+        };
+        vector<ClientResult> results(profile.clients);
+        auto deadline = chrono::steady_clock::now() + profile.duration;
 
-        cout << "Enter product ID: ";
-        cin >> productId;
-        cout << "Enter product name: ";
-        cin >> productName;
-        cout << "Enter price: ";
-        cin >> price;
-        cout << "Enter size (for clothing): ";
-        cin >> size;
-        cout << "Enter color (for clothing): ";
-        cin >> color;
-        try
+        auto client = [&](size_t id)
         {
-            if (productType == 'S' || productType == 's')
+            mt19937_64 rng(profile.seed + id);
+            uniform_real_distribution<double> coin(0.0, 1.0);
+            uniform_int_distribution<size_t> pickCustomer(0, profile.customers - 1);
+            deque<Pending> window;
+            ClientResult &result = results[id];
+            auto settle = [&](Pending &request)
             {
-                cout << "Enter the fabric of shirt:" << endl;
-                cin >> fabric;
-                return make_unique<Shirt>(productId, productName, price, size, color, fabric);
-            }
-            else if (productType == 'J' || productType == 'j')
+                bool ok = false;
+                try
+                {
+                    Expected<bool> outcome = request.done.get();
+                    ok = outcome && *outcome;
+                }
+                catch (exception &ex)
+                {
+                }
+                int64_t nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() -
+                                                                                 request.start)
+                                          .count();
+                (request.cancel ? result.cancel : result.place).add(nanoseconds);
+                result.failed += ok ? 0 : 1;
+            };
+
+            while (chrono::steady_clock::now() < deadline)
             {
-                cout << "Enter the denim style : ";
-                cin >> denim_style;
-                return make_unique<Jeans>(productId, productName, price, size, color, denim_style);
+                while (window.size() >= profile.inFlight ||
+                       (!window.empty() && window.front().done.wait_for(chrono::seconds(0)) == future_status::ready))
+                {
+                    settle(window.front());
+                    window.pop_front();
+                }
+                Customer &customer = customers.getCustomer((int)pickCustomer(rng));
+                uint64_t latest = customer.lastOrderId();
+                Pending request;
+                request.cancel = latest != 0 && coin(rng) < profile.cancelRatio;
+                request.start = chrono::steady_clock::now();
+                if (request.cancel)
+                {
+                    request.done = engine.cancelOrder(customer, latest);
+                }
+                else
+                {
+                    ShoppingCart cart;
+                    cart.add((int)skuRank(rng) + 1, 1);
+                    if (coin(rng) < 0.5)
+                    {
+                        cart.add((int)skuRank(rng) + 1, 1);
+                    }
+                    request.done = engine.placeOrder(customer, cart);
+                }
+                window.push_back(move(request));
             }
-            else
+            for (auto &request : window)
             {
-                throw InvalidClothingException();
+                settle(request);
             }
+        };
+
+        auto start = chrono::steady_clock::now();
+        vector<thread> clients;
+        for (size_t i = 0; i < profile.clients; i++)
+        {
+            clients.emplace_back(client, i);
         }
-        catch (InvalidClothingException &ice)
+        for (auto &worker : clients)
         {
-            cout << ice.what() << endl;
+            worker.join();
         }
-        return NULL;
-    }
-};
-class Order
-{
-public:
-    int orderId;
-    bool isPaid;
-    bool isCancelled = false;   // Initialize to false by default
-    vector<Product *> products; // Order has products
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        engine.stop();
+        gateway.stop();
 
-    Order()
-    {
-        orderId = 0;
-        isPaid = false;
-    }
-    Order(int orderId, bool isPaid)
-    {
-        this->orderId = orderId;
-        this->isPaid = isPaid;
-    }
+        LatencySamples place;
+        LatencySamples cancel;
+        LatencySamples all;
+        size_t failed = 0;
+        for (auto &result : results)
+        {
+            place.merge(result.place);
+            cancel.merge(result.cancel);
+            failed += result.failed;
+        }
+        all.merge(place);
+        all.merge(cancel);
 
-    void addProduct(Product *product)
-    {
-        products.push_back(product);
+        out << "  \"load\": {\n";
+        out << "    \"customers\": " << profile.customers << ", \"skus\": " << profile.skus << ", \"zipf\": ";
+        out << profile.zipfExponent;
+        out << ", \"clients\": " << profile.clients << ",\n";
+        out << "    \"seconds\": " << seconds;
+        out << ", \"requests\": " << all.count() << ", \"failed\": " << failed;
+        out << ", \"throughput_per_s\": " << (int64_t)(all.count() / seconds) << ",\n";
+        writeLatency(out, "place_latency_us", place);
+        out << ",\n";
+        writeLatency(out, "cancel_latency_us", cancel);
+        out << ",\n";
+        writeLatency(out, "latency_us", all);
+        out << "\n  }\n";
     }
-};
-class PaymentGateway
-{
-public:
-    bool processPayment()
+
+    static void writeLatency(ReportBuffer &out, const char *name, LatencySamples &samples)
     {
-        cout << "Payment processed successfully!" << endl;
-        return true;
+        out << "    \"" << name << "\": {\"count\": " << samples.count();
+        out << ", \"p50\": " << samples.quantile(0.50) / 1000;
+        out << ", \"p99\": " << samples.quantile(0.99) / 1000;
+        out << ", \"p999\": " << samples.quantile(0.999) / 1000 << "}";
     }
 };
 
-class Customer
+// Products the console can add on top of the catalogue in one session
+const size_t CONSOLE_PRODUCTS = 1024;
+
+int main(int argc, char *argv[])
 {
-public:
-    string name;
-    int custid;
-    string contactNumber;
-    string address;
-    string emailAddress;
-    vector<Order> orders; // customer has Orders
+    // Create a PaymentGateway object
+    PaymentGateway paymentGateway;
 
-    Customer()
+    // Command line: [--journal <path>] [--invoices <path>] [--catalogue-report <path>]
+    //               [catalogue [snapshot to write]]
+    // Any mode: [--metrics <path>] dumps metrics in the Prometheus text format
+    // or: --bench [--bench-out <path>] [--duration-ms n] [--clients n] [--customers n]
+    //             [--skus n] [--zipf s] [--cancel-ratio r] [--failure-rate r]
+    vector<string> arguments;
+    string journalPath;
+    string invoicesPath;
+    string reportPath;
+    bool bench = false;
+    string benchOut;
+    string metricsPath;
+    LoadProfile profile;
+    for (int i = 1; i < argc; i++)
     {
-        this->custid = 0;
-        this->contactNumber = "";
-        this->address = "";
-        this->emailAddress = "";
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--journal" && hasValue)
+        {
+            journalPath = argv[++i];
+        }
+        else if (option == "--metrics" && hasValue)
+        {
+            metricsPath = argv[++i];
+        }
+        else if (option == "--bench")
+        {
+            bench = true;
+        }
+        else if (option == "--bench-out" && hasValue)
+        {
+            benchOut = argv[++i];
+        }
+        else if (option == "--duration-ms" && hasValue)
+        {
+            profile.duration = chrono::milliseconds(atoll(argv[++i]));
+        }
+        else if (option == "--clients" && hasValue)
+        {
+            profile.clients = max(1, atoi(argv[++i]));
+        }
+        else if (option == "--customers" && hasValue)
+        {
+            profile.customers = max(1, atoi(argv[++i]));
+        }
+        else if (option == "--skus" && hasValue)
+        {
+            profile.skus = max(1, atoi(argv[++i]));
+        }
+        else if (option == "--zipf" && hasValue)
+        {
+            profile.zipfExponent = atof(argv[++i]);
+        }
+        else if (option == "--cancel-ratio" && hasValue)
+        {
+            profile.cancelRatio = atof(argv[++i]);
+        }
+        else if (option == "--failure-rate" && hasValue)
+        {
+            profile.paymentFailureRate = atof(argv[++i]);
+        }
+        else if (option == "--invoices" && hasValue)
+        {
+            invoicesPath = argv[++i];
+        }
+        else if (option == "--catalogue-report" && hasValue)
+        {
+            reportPath = argv[++i];
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
     }
-    Customer(string name, int cid, string contact, string address, string email)
+
+    // The exporter keeps the metrics file current and writes it a last time on exit
+    unique_ptr<MetricsExporter> metrics;
+    if (!metricsPath.empty())
     {
-        this->name = name;
-        this->custid = cid;
-        this->contactNumber = contact;
-        this->address = address;
-        this->emailAddress = email;
+        metrics = make_unique<MetricsExporter>(metricsPath);
+        metrics->start();
     }
 
-    void print()
+    if (bench)
     {
-        cout << "Customer name: " << name << endl;
-        cout << "Contact number: " << contactNumber << endl;
-        cout << "Address: " << address << endl;
-        cout << "Email address: " << emailAddress << endl;
+        int fd = benchOut.empty() ? STDOUT_FILENO : open(benchOut.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            cout << "Could not open " << benchOut << endl;
+            return 1;
+        }
+        {
+            ReportBuffer out(fd);
+            BenchmarkRunner(profile).run(out);
+        }
+        if (fd != STDOUT_FILENO)
+        {
+            close(fd);
+        }
+        return 0;
     }
 
-    // Method to place an order
-    void placeOrder(vector<Product *> &products, PaymentGateway *paymentGateway);
-
-    void cancelOrder(int orderId)
+    // The inventory owns every product in the catalogue, it can be seeded
+    // from a catalogue file given on the command line. A .snap catalogue is
+    // mapped instead of loaded, its products join the inventory when ordered.
+    // A second argument writes the loaded catalogue out as a snapshot.
+    Inventory inventory;
+    unique_ptr<MappedCatalogue> snapshot;
+    if (arguments.size() > 0)
     {
-        for (auto it = orders.begin(); it != orders.end(); it++)
+        string path = arguments[0];
+        try
         {
-            if (it->orderId == orderId)
+            if (path.size() >= 5 && path.compare(path.size() - 5, 5, ".snap") == 0)
             {
-                
-                // Erase the cancelled order from the customer's orders vector
-                orders.erase(it);
-
-                cout << "Order with ID " << orderId << " has been cancelled." << endl;
-                return;
+                snapshot = make_unique<MappedCatalogue>(path);
+                cout << "Mapped " << snapshot->size() << " products from " << path << endl;
+            }
+            else
+            {
+                CatalogueLoadResult loaded = ProductFactory::loadCatalogue(path, inventory);
+                cout << "Loaded " << loaded.loaded << " products from " << path;
+                cout << " (" << loaded.rejected << " rows rejected)" << endl;
+                ProductTable &columns = inventory.columns();
+                cout << "Units in stock: " << columns.totalStock() << ", out of stock products: ";
+                cout << columns.countOutOfStock() << endl;
+                if (arguments.size() > 1)
+                {
+                    MappedCatalogue::write(inventory, arguments[1]);
+                    cout << "Wrote snapshot " << arguments[1] << endl;
+                }
             }
         }
-
-        // If the loop finishes without finding the order, throw InvalidOrderIDException
-        throw InvalidOrderIDException();
+        catch (ProductCreationException &pce)
+        {
+            cout << pce.what() << endl;
+        }
+        catch (SnapshotException &se)
+        {
+            cout << se.what() << endl;
+        }
     }
-};
 
-void Customer::placeOrder(vector<Product *> &products, PaymentGateway *paymentGateway)
-{
-    // Create a new order
-    static int nextOrderId = 1;
-    Order newOrder(nextOrderId++, false);
-
-    // Add all the products present in the vector to the Order of customer
-    for (auto product : products)
+    // Writes the details of every catalogue product, grouped by type
+    if (!reportPath.empty())
     {
-        newOrder.addProduct(product);
+        ProductSheet sheet = ProductSheet::fromInventory(inventory);
+        for (size_t i = 0; snapshot != NULL && i < snapshot->size(); i++)
+        {
+            ProductPtr product = snapshot->materialize(snapshot->recordAt(i));
+            if (product != NULL)
+            {
+                sheet.add(*product);
+            }
+        }
+        int fd = open(reportPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            cout << "Could not open " << reportPath << endl;
+        }
+        else
+        {
+            bool written;
+            {
+                ReportBuffer out(fd);
+                sheet.writeDetails(out);
+                written = out.flush();
+            }
+            close(fd);
+            cout << (written ? "Wrote details of " : "Could not write details of ") << sheet.size();
+            cout << " products to " << reportPath << endl;
+        }
     }
 
-
-    // Display order details
-    cout << "Order Details:" << endl;
-    cout << "Order ID: " << newOrder.orderId << endl;
-    cout << "Customer Name: " << name << endl;
-    cout << "Products: ";
-    for (auto product : newOrder.products)
+    // Products are looked up in the inventory first, then in the mapped snapshot
+    auto catalogueProduct = [&inventory, &snapshot](int productId)
     {
-        cout << product->product_name << ", ";
-    }
-    cout << endl;
+        Product *product = inventory.findProduct(productId);
+        const SnapshotRecord *mapped = snapshot != NULL ? snapshot->find(productId) : NULL;
+        if (product == NULL && mapped != NULL)
+        {
+            product = inventory.addProduct(snapshot->materialize(*mapped));
+        }
+        return product;
+    };
 
+    // Customers live in the directory
+    CustomerDirectory customers;
+    Customer &customer = *customers.addCustomer("John Doe", 12345, "9880854465", "123 Main St", "john.doe@gmail.com");
 
-    // Process the payment using the payment gateway
-    double totalAmount = 0.0;
-    for (auto product : newOrder.products)
+    // Recover the orders of earlier runs from the journal, then keep appending to it.
+    // Checkpoints keep the part of the journal replayed at startup short.
+    unique_ptr<OrderJournal> journal;
+    unique_ptr<JournalCheckpointer> checkpointer;
+    if (!journalPath.empty())
     {
-        totalAmount += product->quantity * product->price;
+        auto customerFor = [&customers](int custid)
+        {
+            return customers.findCustomer(custid);
+        };
+        size_t replayed = OrderJournal::replay(journalPath, inventory, customerFor, catalogueProduct);
+        cout << "Replayed " << replayed << " journal records from " << journalPath << endl;
+        journal = make_unique<OrderJournal>(journalPath);
+        checkpointer = make_unique<JournalCheckpointer>(*journal);
+        checkpointer->start();
     }
 
+    // Products keep joining the inventory from the snapshot and the console
+    // while orders run, so the room for them is made now and fixed
+    inventory.reserve(inventory.size() + (snapshot != NULL ? snapshot->size() : 0) + CONSOLE_PRODUCTS);
+    inventory.fixCapacity();
 
-    if (paymentGateway->processPayment())
-    {
-        newOrder.isPaid = true;
-        orders.push_back(newOrder); // Add the order to the customer's order history
-        cout << "Amount to be paid : " << totalAmount << endl;
-        cout << "Order successfully placed  !" << endl;
-    }
-    else
+    // Place and cancel requests run on the order engine's worker pool
+    OrderEngine engine(inventory, paymentGateway);
+    engine.setJournal(journal.get());
+
+    // Cancelled orders are dropped from the history in the background, and
+    // with a journal old history is paged out next to it
+    unique_ptr<OrderArchive> archive;
+    if (!journalPath.empty())
     {
-        cout << "Payment failed. Order not placed." << endl;
+        archive = make_unique<OrderArchive>(journalPath + ".history");
     }
-}
-
-int main()
-{
-    // Create a PaymentGateway object
-    PaymentGateway paymentGateway;
-
-    // Create a customer object
-    Customer customer("John Doe", 12345, "9880854465", "123 Main St", "john.doe@gmail.com");
+    OrderCompactor compactor(customers, chrono::milliseconds(500), archive.get());
+    compactor.start();
 
-    double totalBill = 0.0;
+    Money totalBill;
     char choice;
     try
     {
@@ -723,57 +7548,65 @@ int main()
 
             if (choice == '1')
             {
-                char categoryChoice;
-                cout << "Select a category (E for Electronics, F for Furniture, C for Clothing): ";
-                cin >> categoryChoice;
-
-                // Place an order based on the user's choice
-                vector<Product *> products;
-                if (categoryChoice == 'E' || categoryChoice == 'e')
-                {
-                    // Electronics category
-                    products.push_back(ProductFactory::createProduct("Electronics").release());
-                }
-                else if (categoryChoice == 'F' || categoryChoice == 'f')
-                {
-                    // Furniture category
-                    products.push_back(ProductFactory::createProduct("Furniture").release());
-                }
-                else if (categoryChoice == 'C' || categoryChoice == 'c')
-                {
-                    // Clothing category
-                    products.push_back(ProductFactory::createProduct("Clothing").release());
-                }
-                else
+                // Fill the shopping cart one product at a time
+                ShoppingCart cart;
+                char more;
+                do
                 {
-                    throw ProductNotFoundException();
-                }
+                    char categoryChoice;
+                    cout << "Select a category (E for Electronics, F for Furniture, C for Clothing): ";
+                    cin >> categoryChoice;
 
+                    // Add a product based on the user's choice
+                    ProductPtr created;
+                    if (categoryChoice == 'E' || categoryChoice == 'e')
+                    {
+                        // Electronics category
+                        created = ProductFactory::createProduct("Electronics");
+                    }
+                    else if (categoryChoice == 'F' || categoryChoice == 'f')
+                    {
+                        // Furniture category
+                        created = ProductFactory::createProduct("Furniture");
+                    }
+                    else if (categoryChoice == 'C' || categoryChoice == 'c')
+                    {
+                        // Clothing category
+                        created = ProductFactory::createProduct("Clothing");
+                    }
+                    else
+                    {
+                        throw ProductNotFoundException();
+                    }
+                    if (created == NULL)
+                    {
+                        throw ProductNotFoundException();
+                    }
 
-                // Place the order for the products
-                cout << "Enter the quantity for this order: ";
-                cin >> quantity;
-                if (quantity < 0)
-                {
-                    throw NegativeQuantityException();
-                }
-                for (const auto &product : products)
-                {
-                    product->quantity = quantity; // Set the product quantity to the user input
-                }
+                    // Orders refer to the catalogue entry, a known product id reuses the existing one
+                    Product *product = catalogueProduct(created->product_id);
+                    if (product == NULL)
+                    {
+                        product = inventory.addProduct(move(created));
+                    }
+
+                    cout << "Enter the quantity for this product: ";
+                    cin >> quantity;
+                    cart.add(product->product_id, quantity);
 
+                    cout << "Add another product to this order? (Y/N): ";
+                    cin >> more;
+                } while (more == 'Y' || more == 'y');
+
+                // Place the order for all the products in the cart
                 try
                 {
-                    customer.placeOrder(products, &paymentGateway);
-                }
-                catch (PaymentProcessingException &ex)
-                {
-                    cout << ex.what() << endl;
-                    continue;
-                }
-                catch (NegativeQuantityException &nqe)
-                {
-                    cout << nqe.what() << endl;
+                    Expected<bool> placed = engine.placeOrder(customer, cart).get();
+                    if (!placed)
+                    {
+                        cout << describe(placed.error()) << endl;
+                        continue;
+                    }
                 }
                 catch (exception &ex)
                 {
@@ -785,16 +7618,13 @@ int main()
             }
             else if (choice == '2')
             {
-                int orderIdToCancel;
+                uint64_t orderIdToCancel;
                 cout << "Enter the Order ID to cancel: ";
                 cin >> orderIdToCancel;
-                try
-                {
-                    customer.cancelOrder(orderIdToCancel);
-                }
-                catch (InvalidOrderIDException &ioe)
+                Expected<bool> cancelled = engine.cancelOrder(customer, orderIdToCancel).get();
+                if (!cancelled)
                 {
-                    cout << ioe.what();
+                    cout << describe(cancelled.error());
                 }
             }
             
@@ -819,42 +7649,48 @@ int main()
     {
         cout << pnfe.what() << endl;
     }
+    catch (InventoryFullException &ife)
+    {
+        cout << ife.what() << endl;
+    }
+
+    engine.stop();
+    compactor.stop();
+    if (journal != NULL)
+    {
+        checkpointer->stop();
+        journal->close();
+    }
 
     // Print the final bill
-    cout << "=========================================" << endl;
-    cout << "           INVOICE - Total Bill          " << endl;
-    cout << "=========================================" << endl;
-    cout << "Customer Name: " << customer.name << endl;
-    cout << "Customer ID: " << customer.custid << endl;
-    cout << "Contact Number: " << customer.contactNumber << endl;
-    cout << "Address: " << customer.address << endl;
-    cout << "Email Address: " << customer.emailAddress << endl;
-    cout << "-----------------------------------------" << endl;
-    cout << "Order Details:" << endl;
+    {
+        ReportBuffer out(cout);
+        InvoiceRenderer invoice;
+        totalBill = invoice.render(customer, inventory, out);
+    }
 
-    for (const auto &order : customer.orders)
+    // Invoices of every customer can also be written out in one go
+    if (!invoicesPath.empty())
     {
-        if (order.isCancelled == false)
+        int fd = open(invoicesPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            cout << "Could not open " << invoicesPath << endl;
+        }
+        else
         {
-            cout << "Order ID: " << order.orderId << endl;
-            cout << "Products: " << endl;
-            double subtotal = 0.0;
-            for (const auto &product : order.products)
+            try
             {
-                cout << "- " << product->product_name;
-                cout << " x " << product->quantity << " (Price per item: Rs" << product->getPrice() << ")" << endl;
-                subtotal += product->getPrice() * product->quantity;
+                size_t written = InvoiceRenderer::renderAll(customers, inventory, fd);
+                cout << "Wrote " << written << " invoices to " << invoicesPath << endl;
             }
-            cout << "Subtotal for this order: Rs. " << subtotal << endl << endl;
-            cout << "-----------------------------------------" << endl;
-
-            // Add the subtotal of non-cancelled and in-stock orders to the total bill
-            totalBill += subtotal;
+            catch (ReportWriteException &rwe)
+            {
+                cout << rwe.what() << endl;
+            }
+            close(fd);
         }
     }
 
-    cout << "\nTotal Amount to be Paid: Rs. " << totalBill << endl;
-    cout << "=========================================" << endl;
-
     return 0;
 }